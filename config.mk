@@ -1,13 +1,13 @@
 # Uncomment to statically link with musl
 #CC      = musl-gcc
-#LDFLAGS = -lm -static -s
+#LDFLAGS = -lm -lpthread -static -s
 #CFLAGS  = -D_GNU_SOURCE -std=c11 -pedantic -Ofast \
 
 CC      = gcc
-LDFLAGS = -lm -s
-CFLAGS  = -D_GNU_SOURCE -std=c11 -pedantic -O3
+LDFLAGS = -lm -lpthread -lrt -s
+CFLAGS  = -D_GNU_SOURCE -std=c11 -pedantic -pthread -O3
 
-#LDFLAGS = -lm
+#LDFLAGS = -lm -lpthread
 #CFLAGS  = -D_GNU_SOURCE -g -static -std=c11 -Wpedantic -Wall -Wextra \
           -Wbad-function-cast -Wcast-align -Wcast-qual -Wduplicated-branches \
 		  -Wfloat-equal -Wformat=2 -Wformat-truncation=2 \
@@ -1,4 +1,6 @@
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -6,6 +8,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <tgmath.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "util.h"
 
@@ -22,6 +35,37 @@
 #define RIGHTMOST_BIT_ON(x)  ((x) |= 0x01)
 #define RIGHTMOST_BIT_OFF(x) ((x) &= 0xFE)
 #define DIR_MAX              (PATH_MAX - NAME_MAX)
+#define ALIGN_UP(x, a)       (((x) + (a) - 1) / (a) * (a))
+#define MIN(a, b)            ((a) < (b) ? (a) : (b))
+#define MAX(a, b)            ((a) > (b) ? (a) : (b))
+#define REGION_CHUNK_BLOCKS  65536 /* max sections read at once by recoverregion() */
+#define PROGRESSIVE_LEVELS   3     /* 1/16, 1/4 and full resolution */
+#define STREAM_CHUNK         (1 << 20) /* bytes written at once when streaming to stdout */
+#define VERIFY_SUBSETS       4     /* random k-subsets of the shadows --verify uses */
+#define PLAN_READ_RATE       500e6 /* bytes/s assumed for reading by --plan */
+#define PLAN_WRITE_RATE      300e6 /* bytes/s assumed for writing by --plan */
+#define PLAN_CALIBRATION     (1 << 18) /* secret bytes shared to calibrate --plan */
+#define SHARD_INIT           0          /* --shard init/m */
+#define SHARD_CHECK          UINT32_MAX /* --shard check/m */
+#define RESHARE_CHUNK        65536 /* secret bytes handled at once by reshareimage() */
+#define Y4M_MAGIC            "YUV4MPEG2 "
+#define Y4M_LINE_MAX         4096
+#define VIDEO_QUEUE_DEPTH    4     /* frames in flight between pipeline stages */
+#define RAW_MAGIC            "SSS\x1A"
+#define RAW_VERSION          1
+#define RAW_HEADER_SIZE      36
+#define RAW_ALIGNMENT        4096 /* payload offset; a multiple of the page size */
+#define CRC_OFFSET           (BMP_HEADER_SIZE + DIB_HEADER_SIZE + 3) /* see setshadowcrc() */
+#define ARCHIVE_MAGIC        "SSA\x1A"
+#define ARCHIVE_VERSION      1
+#define ARCHIVE_HEADER_SIZE  8
+#define ARCHIVE_ENTRY_SIZE   16
+#define JOURNAL_MAGIC        "bmpsss journal"
+#define COVER_CACHE_SLOTS    256        /* covers the --cover-cache indexes */
+#define COVER_CACHE_VERSION  2
+#define DEFAULT_NAME         "shadow%d.bmp"
+#define DEFAULT_JOBS         4
+#define DIRECT_ALIGNMENT     4096 /* buffer and length granularity of O_DIRECT */
 
 typedef struct {
     uint8_t  id[2];   /* magic number to identify the BMP format */
@@ -51,13 +95,215 @@ typedef struct {
     DIBheader dibheader;             /* 40 bytes DIB header */
     uint8_t   palette[PALETTE_SIZE]; /* color palette; mandatory for depth <= 8 */
     uint8_t   *imgpixels;            /* array of bytes representing each pixel */
+    void      *mapping;              /* if not NULL, imgpixels points into it */
+    size_t    maplength;             /* length of mapping */
 } Bitmap;
 
+/* 36 bytes header of a raw shadow container. The shadow pixels follow at
+ * payloadoffset, which is aligned to RAW_ALIGNMENT so they can be mmapped */
+typedef struct {
+    uint8_t  magic[4];      /* RAW_MAGIC */
+    uint16_t version;       /* RAW_VERSION */
+    uint16_t seed;          /* key (seed) */
+    uint16_t shadownumber;  /* shadow number */
+    uint16_t k;             /* threshold used when distributing */
+    uint32_t width;         /* width of the secret image */
+    int32_t  height;        /* height of the secret image */
+    uint16_t prime;         /* order of the field, PRIME */
+    uint16_t reserved;      /* must be 0 */
+    uint32_t checksum;      /* CRC-32C of the payload */
+    uint32_t payloadoffset; /* starting address of the shadow pixels */
+    uint32_t payloadsize;   /* size of the shadow pixels */
+} RAWheader;
+
+/* An archive starts with this 8 bytes header, followed by count index entries.
+ * Each entry locates a raw shadow container stored further in the file */
+typedef struct {
+    uint8_t  magic[4]; /* ARCHIVE_MAGIC */
+    uint16_t version;  /* ARCHIVE_VERSION */
+    uint16_t count;    /* number of entries in the index table */
+} ARCHIVEheader;
+
+/* 16 bytes index table entry */
+typedef struct {
+    uint16_t shadownumber; /* shadow number of the container */
+    uint16_t reserved;     /* must be 0 */
+    uint32_t size;         /* size of the raw container */
+    uint64_t offset;       /* starting address of the raw container */
+} ARCHIVEentry;
+
+/* A resolution level of a progressive distribution. Levels are shared one
+ * after the other, lowest resolution first, each starting at offset in the
+ * shadows */
+typedef struct {
+    uint32_t width;  /* width of the downsampled image */
+    int32_t  height; /* height of the downsampled image */
+    uint32_t size;   /* size of its pixel array */
+    uint32_t offset; /* index of its first byte in the shadows */
+    uint32_t shares; /* bytes it takes in each shadow */
+} Level;
+
+/* A frame of a video being distributed, as it moves through the pipeline */
+typedef struct {
+    uint32_t index;    /* frame number, starting at 0 */
+    Bitmap   *bmp;     /* the frame, as a bottom-up bitmap */
+    Bitmap   **shadows; /* its n shadows, once shared */
+    double   readtime; /* monotime() when it was read */
+} Frame;
+
+/* State shared by the stages of distributevideo() */
+typedef struct {
+    FILE     *fp;         /* Y4M stream */
+    uint32_t width;       /* frame width */
+    int32_t  height;      /* frame height */
+    size_t   chromasize;  /* bytes of chroma planes to skip after luma */
+    uint16_t k;
+    uint16_t n;
+    uint16_t seed;
+    bool     delta;       /* reuse shares of sections equal to the last frame */
+    Queue    read;        /* frames read, waiting to be shared */
+    Queue    shared;      /* frames shared, waiting to be written */
+} Video;
+
+/* State shared by the readers of recoverhedged(). The first k distinct
+ * shadows to arrive win, the rest are cancelled */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  done;     /* signaled whenever a reader finishes */
+    uint32_t        width;
+    int32_t         height;
+    uint16_t        k;
+    Bitmap          **shadows; /* the first k shadows to arrive */
+    const char      **paths;   /* the files they came from */
+    size_t          count;     /* number of elements of shadows */
+    size_t          finished;  /* readers done, with a shadow or not */
+    double          start;     /* monotime() when the race started */
+    double          *latencies; /* seconds each arrival took, in order */
+} Race;
+
+/* One of the candidates of a Race, read by a hedgedreader() */
+typedef struct {
+    Race       *race;
+    const char *path;
+} Candidate;
+
+/* State shared by the shadowloader()s of recoverimage(). Candidates are
+ * handed out in rank order until k shadows pass their checksum, or there are
+ * none left */
+typedef struct {
+    pthread_mutex_t lock;
+    char            **paths;  /* ranked candidates */
+    size_t          count;    /* number of elements of paths */
+    size_t          next;     /* first candidate not handed out yet */
+    Bitmap          **shadows;
+    size_t          loaded;   /* number of elements of shadows */
+    size_t          pending;  /* candidates being loaded */
+    uint32_t        width;
+    int32_t         height;
+    uint16_t        k;
+} Loading;
+
+/* A valid shadow file found by getwarmfilenames(), ranked for use */
+typedef struct {
+    char   *path;
+    double resident; /* fraction of the part read that's in the page cache */
+    off_t  size;
+    size_t order;    /* position in the directory, to break ties */
+} Candidatefile;
+
+/* A cover found by planbatch(), from its headers alone */
+typedef struct {
+    char     *path;
+    uint32_t capacity; /* pixels, so capacity / 8 shadow bytes */
+    uint32_t imagesize;
+    off_t    size;     /* of the file */
+} Plancover;
+
+/* A shadow a previous run recorded in the --journal as written */
+typedef struct {
+    uint32_t frame;        /* video frame index; 0 for --secret */
+    uint16_t shadownumber;
+    uint32_t crc;          /* CRC-32C of the shadow */
+} Journalentry;
+
+/* A cover file in the --cover-cache. Lookups don't lock: a slot is only
+ * reused once key was cleared and no reader was left, see cachedcover() */
+typedef enum {
+    SLOT_FREE,
+    SLOT_FILLING, /* its extent is being read into */
+    SLOT_LIVE,
+    SLOT_RETIRED, /* evicted while being read; freed once readers is 0 */
+} Slotstate;
+
+typedef struct {
+    _Atomic uint64_t key;     /* hash of the file identity; 0 unless live */
+    _Atomic uint64_t lastuse; /* cache clock at the last hit, for LRU */
+    _Atomic uint32_t readers; /* processes copying the cover out */
+    Slotstate        state;   /* changed under the cache lock */
+    pid_t            filler;  /* process reading it in while SLOT_FILLING */
+    uint64_t         dev, ino, size;
+    int64_t          mtime;   /* nanoseconds */
+    uint64_t         offset;  /* of the file bytes in the data area */
+    uint64_t         length;
+} Cacheslot;
+
+/* Start of the --cover-cache shared memory object, followed by the data area
+ * at a page boundary */
+typedef struct {
+    _Atomic uint32_t ready;   /* set once initialized by its creator */
+    uint32_t         version;
+    uint64_t         capacity; /* bytes of the data area */
+    _Atomic uint64_t clock;
+    pthread_mutex_t  lock;     /* robust and process shared; taken to insert */
+    Cacheslot        slots[COVER_CACHE_SLOTS];
+} Covercache;
+
+/* How shadow BMPs are written, see writebmp() */
+typedef enum {
+    IO_STDIO,  /* stdio streams */
+    IO_PWRITE, /* one pwrite for the headers and one for the pixels */
+    IO_DIRECT, /* O_DIRECT from an aligned buffer, bypassing the page cache */
+    IO_MMAP,   /* into a mapping of the file, sized beforehand */
+} IOmode;
+
+/* How outputs are made to persist, see commitoutput() */
+typedef enum {
+    DURABLE_NONE,   /* left to the kernel */
+    DURABLE_FSYNC,  /* fdatasync each file before renaming it into place */
+    DURABLE_SYNCFS, /* one syncfs per batch, then rename them all */
+} Durability;
+
+/* Where a shadow is delivered to instead of --out-dir, see sendshadow() */
+typedef enum {
+    SINK_DIR,  /* a file in another directory */
+    SINK_FIFO, /* a named pipe, opened once a reader is there */
+    SINK_UNIX, /* a Unix stream socket, connected to */
+    SINK_EXEC, /* the stdin of a shell command */
+} SinkType;
+
+typedef struct {
+    uint16_t   shadownumber;
+    SinkType   type;
+    const char *target; /* path, or command for SINK_EXEC */
+} Sink;
+
+/* A shadow waiting for a shadowwriter() to hide it in its cover and write it.
+ * With --io mmap, the shadow is embedded from the cover file straight into
+ * the output; otherwise the cover is read whole first */
+typedef struct {
+    const Bitmap *shadow;
+    const char   *coverpath;
+    const Sink   *sink;     /* where to deliver it, or NULL for path */
+    char         path[PATH_MAX];
+} Output;
+
 typedef bool (*fn)(FILE *, uint16_t, uint32_t);
 /* prototypes */
 static long     randint(long max);
+static long     randint48(unsigned short xsubi[3], long max);
 static void     swap(uint8_t *s, uint8_t *t);
 static int      countfiles(const char *dirname);
+static bool     issamedir(const char *a, const char *b);
 static void     usage(void);
 static uint32_t get32bitsfromheader(FILE *fp, int offset);
 static uint32_t bmpfilewidth(FILE *fp);
@@ -77,29 +323,169 @@ static Bitmap   *bmpfromfile(const char *filename);
 static bool     isvalidbmpsize(FILE *fp, uint16_t k, uint32_t secretsize);
 static bool     kdivisiblesize(FILE *fp, uint16_t k);
 static void     bmptofile(const Bitmap *bp, const char *filename);
+static uint32_t shadowsize(uint32_t secretsize, uint16_t k);
 static void     findclosestpair(uint32_t x, uint32_t *width, int32_t *height);
 static Bitmap   *newshadow(uint32_t width, int32_t height, uint16_t seed, uint16_t shadownumber);
+static void     shareblocks(const uint8_t *data, uint32_t blocks, uint16_t k, Bitmap **shadows, uint16_t n, uint32_t offset);
 static Bitmap   **formshadows(const Bitmap *bp, uint16_t k, uint16_t n, uint16_t seed);
+static uint32_t progressivelevels(uint32_t width, int32_t height, uint16_t k, Level levels[static PROGRESSIVE_LEVELS]);
+static Bitmap   *downsample(const Bitmap *bp, uint32_t factor);
+static Bitmap   **formprogressiveshadows(const Bitmap *bp, uint16_t k, uint16_t n, uint16_t seed);
 static void     findcoefficients(int **mat, uint16_t k);
-static Bitmap   *revealsecret(Bitmap **shadows, uint32_t width, int32_t height, uint16_t k);
+static int      **newmatrix(size_t rows, size_t cols);
+static void     freematrix(int **mat, size_t rows);
+static void     interpolationmatrix(const uint16_t *shadownumbers, uint16_t k, int **inv);
+static void     evaluationmatrix(int **inv, uint16_t k, const uint16_t *xs, size_t count, int **out);
+static void     revealblock(int **inv, const uint8_t *values, uint16_t k, uint8_t *pixels);
+static Bitmap   *revealsecret(Bitmap **shadows, uint32_t width, int32_t height, uint16_t k, int outfd);
+static bool     solvesystem(int **mat, size_t rows, size_t cols, int *solution);
+static bool     correctblock(int **mat, int *solution, const uint16_t *shadownumbers, const uint8_t *values, uint16_t m, uint16_t k, uint8_t *pixels);
+static Bitmap   *revealcorrecting(Bitmap **shadows, uint16_t m, uint32_t width, int32_t height, uint16_t k, uint32_t *faults);
+static void     embedbytes(uint8_t *cover, const uint8_t *in, size_t count);
+static void     extractbytes(const uint8_t *cover, uint8_t *out, size_t count);
 static void     hideshadow(Bitmap *bp, const Bitmap *shadow);
+static void     hideshadowto(Bitmap *bp, const Bitmap *shadow, const char *filename);
+static void     embedshadow(Bitmap *bp, const Bitmap *shadow);
+static void     embedbytesto(uint8_t *out, const uint8_t *cover, const uint8_t *in, size_t count);
+static uint8_t  *createmapped(const char *filename, size_t length, int *fd);
+static void     writebmpto(const Bitmap *bp, FILE *fp);
+static void     tempname(char tmp[static PATH_MAX], const char *path);
+static int      createoutput(const char *path, int flags);
+static FILE     *createoutputstream(const char *path);
+static void     commitoutput(int fd, const char *path);
+static void     syncoutputs(void);
+static Durability parsedurability(const char *mode);
+static void     parsesink(char *spec);
+static const Sink *findsink(uint16_t shadownumber);
+static void     sendshadow(const Bitmap *bp, const Sink *sink);
+static void     hideshadowmapped(const char *coverpath, const Bitmap *shadow, const char *filename);
+static void     writebmp(const Bitmap *bp, const char *filename);
+static void     bmpheadertobuffer(const Bitmap *bp, uint8_t *buf);
+static void     *shadowwriter(void *arg);
+static void     opencovercache(const char *spec);
+static uint64_t cachekey(const struct stat *st);
+static bool     isslotof(const Cacheslot *slot, const struct stat *st);
+static Bitmap   *cachedcover(uint64_t key, const struct stat *st);
+static Cacheslot *reserveslot(uint64_t length, const struct stat *st);
+static void     lockcache(void);
+static Bitmap   *coverfromfile(const char *path);
+static void     shadowpath(char path[static PATH_MAX], uint16_t shadownumber);
+static void     rawshadowpath(char path[static PATH_MAX], uint16_t shadownumber);
+static void     parsename(const char *template);
+static IOmode   parseio(const char *mode);
+static void     setshadowcrc(Bitmap *bp, uint32_t crc, uint32_t length);
+static uint32_t getshadowcrc(const Bitmap *bp);
+static uint32_t getshadowlength(const Bitmap *bp);
+static void     writeshadowcrc(int fd, uint32_t crc, uint32_t length);
+static Bitmap   *loadshadow(const char *path, uint32_t width, int32_t height, uint16_t k);
+static char     **getrankedfilenames(const char *dir, uint16_t k, fn isvalid, uint32_t size, size_t *count);
 static Bitmap   *retrieveshadow(const Bitmap *bp, uint32_t width, int32_t height, uint16_t k);
 static bool     isbmp(FILE *fp);
+static bool     iswholebmp(FILE *fp);
 static bool     isvalidshadow(FILE *fp, uint16_t k, uint32_t secretsize);
-static bool     isvalidbmp(FILE *fp, uint16_t k, uint32_t ignoredparameter);
+static bool     isvalidbmp(FILE *fp, uint16_t k, uint32_t secretsize);
 static char     **getvalidfilenames(const char *dir, uint16_t k, uint16_t n, fn isvalid, uint32_t size);
 static char     **getbmpfilenames(const char *dir, uint16_t k, uint16_t n, uint32_t size);
 static char     **getshadowfilenames(const char *dir, uint16_t k, uint32_t size);
+static char     **loadshadows(const char *dir, Bitmap **shadows, uint32_t width, int32_t height, uint16_t k);
+static char     **getwarmfilenames(const char *dir, uint16_t k, uint16_t n, fn isvalid, uint32_t size);
+static int      comparecandidates(const void *a, const void *b);
 static void     distributeimage(const char *dir, const char *imgpath, uint16_t k, uint16_t n, uint16_t seed);
 static void     recoverimage(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k);
+static void     *shadowloader(void *arg);
+static void     planbatch(const char *dir, char **secrets, size_t count, uint16_t k, uint16_t n);
+static void     calibrate(uint16_t k, uint16_t n, double *sharerate, double *embedrate);
+static void     openjournal(uint16_t k, uint16_t n, uint16_t seed, uint32_t width, int32_t height);
+static void     closejournal(void);
+static int      comparejournalentries(const void *a, const void *b);
+static bool     isjournaled(uint32_t frame, const Bitmap *shadow, const char *path);
+static void     journalshadow(uint32_t frame, const Bitmap *shadow);
+static bool     isshadowwritten(const char *path, const Bitmap *shadow, uint32_t crc);
+static void     verifyshadows(const Bitmap *secret, Bitmap **shadows, uint16_t k, uint16_t n, double percent);
+static double   parseverify(const char *arg);
+static void     writerevealed(Bitmap **shadows, uint32_t width, int32_t height, uint16_t k, const char *filename);
+static void     *hedgedreader(void *arg);
+static void     recoverhedged(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k, uint16_t m);
+static void     lagrangeweights(const uint16_t *shadownumbers, uint16_t k, uint16_t x, int *weights);
+static void     extendimage(const char *dir, const char *coverpath, uint32_t width, int32_t height, uint16_t k, uint16_t shadownumber);
+static bool     ready4mheader(FILE *fp, uint32_t *width, int32_t *height, size_t *chromasize);
+static Bitmap   *readframe(FILE *fp, uint32_t width, int32_t height, size_t chromasize, uint16_t seed);
+static Bitmap   **shareframe(const Bitmap *bp, const Bitmap *prev, uint8_t **prevshares, uint16_t k, uint16_t n, uint16_t seed);
+static void     *videoreader(void *arg);
+static void     *videosharer(void *arg);
+static void     distributevideo(const char *dir, const char *path, uint16_t k, uint16_t n, uint16_t seed, bool delta);
+static void     deltaimage(const char *dir, const char *imgpath, const char *oldpath, uint16_t k, uint16_t n);
+static void     parseshard(const char *arg);
+static void     shardmarker(char path[static PATH_MAX], uint32_t index);
+static void     shardrange(uint32_t blocks, uint32_t index, uint32_t *first, uint32_t *last);
+static void     readsecretslice(int fd, const Bitmap *header, uint32_t from, uint32_t count, uint8_t *out);
+static void     openshardoutputs(uint16_t n, uint32_t blocks, FILE **fps, uint32_t *offsets, uint16_t *shadownumbers);
+static void     shardinit(const char *dir, const char *imgpath, uint16_t k, uint16_t n, uint16_t seed);
+static void     shardwork(const char *imgpath, uint16_t k, uint16_t n);
+static void     shardcheck(const char *imgpath, uint16_t k, uint16_t n);
+static void     reshareimage(const char *dir, const char *coverdir, uint32_t width, int32_t height, uint16_t k, uint16_t newk, uint16_t newn);
+static void     recovercorrecting(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k, uint16_t m);
+static uint32_t filerow(int32_t height, uint32_t row);
+static void     readshares(FILE **fps, const uint32_t *offsets, uint16_t k, uint32_t firstblock, uint32_t blocks, uint8_t *shares);
+static void     embedrange(int infd, int outfd, uint32_t inoffset, uint32_t outoffset, const uint8_t *shares, uint32_t first, uint32_t count);
+static void     revealrun(FILE **fps, const uint32_t *offsets, const uint16_t *shadownumbers, uint16_t k, uint32_t firstblock, uint32_t lastblock, uint8_t *secret);
+static uint16_t openshadowfiles(char **filepaths, uint16_t k, FILE **fps, uint32_t *offsets, uint16_t *shadownumbers);
+static void     recoverpreview(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k, uint16_t level);
+static void     recoverregion(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k, uint32_t rowfrom, uint32_t rowto, uint32_t colfrom, uint32_t colto);
+static void     parserange(char *arg, uint32_t *from, uint32_t *to);
 static uint32_t calculatepixelarraysize(uint32_t width, int32_t height);
+static uint32_t sharedpixels(uint32_t width, int32_t height);
+static uint8_t  *packpixels(const Bitmap *bp);
+static void     unpackrows(Bitmap *bp, const uint8_t *packed, uint32_t first, uint32_t last);
 static void     truncategrayscale(Bitmap *bp);
 static void     permutepixels(Bitmap *bp, uint16_t seed);
 static void     unpermutepixels(Bitmap *bp, uint16_t seed);
 static uint8_t  generatepixel(const uint8_t *coeff, uint16_t degree, uint16_t value);
+static void     changerawendianness(RAWheader *h);
+static bool     readrawheader(RAWheader *h, FILE *fp);
+static void     writerawheader(const RAWheader *h, FILE *fp);
+static uint32_t rawcontainersize(uint32_t pixels);
+static void     writerawshadow(const Bitmap *shadow, uint16_t k, uint32_t width, int32_t height, FILE *fp);
+static void     shadowtorawfile(const Bitmap *shadow, uint16_t k, uint32_t width, int32_t height, const char *filename);
+static Bitmap   *maprawshadow(FILE *fp, off_t base, const char *name, uint16_t k, uint32_t width, int32_t height);
+static Bitmap   *shadowfromrawfile(const char *filename, uint16_t k, uint32_t width, int32_t height);
+static bool     isvalidrawshadow(FILE *fp, uint16_t k, uint32_t secretsize);
+static void     changearchiveendianness(ARCHIVEheader *h, ARCHIVEentry *entries);
+static void     shadowstoarchive(Bitmap **shadows, uint16_t n, uint16_t k, uint32_t width, int32_t height, const char *filename);
+static void     shadowsfromarchive(Bitmap **shadows, const char *filename, uint16_t k, uint32_t width, int32_t height);
+static void     parsesubset(char *list);
 
 /* globals */
 static const char    *argv0;           /* program name for usage() */
+static bool          raw;              /* write/read raw shadow containers */
+static bool          progressive;      /* share a resolution pyramid */
+static bool          timing;           /* report timings on stderr */
+static const char    *archivepath;     /* write/read shadows to/from an archive */
+static uint16_t      *subset;          /* shadow numbers to archive; all if NULL */
+static uint16_t      subsetsize;       /* number of elements of subset */
+static const char    *outdir = ".";    /* directory the shadows are written to */
+static const char    *nametemplate = DEFAULT_NAME; /* shadow file names */
+static IOmode        iomode;           /* how shadows are written */
+static long          jobs = DEFAULT_JOBS; /* threads reading and writing covers */
+static Durability    durability;       /* how outputs are made to persist */
+static double        synctime;         /* seconds spent syncing, for --timing */
+static char          **pending;        /* outputs waiting for syncoutputs() */
+static size_t        pendingcount;     /* number of elements of pending */
+static pthread_mutex_t outputlock = PTHREAD_MUTEX_INITIALIZER; /* guards the above two */
+static Sink          *sinks;           /* --sink deliveries */
+static size_t        sinkcount;        /* number of elements of sinks */
+static double        verifypercent;    /* sections checked after -d; 0 for none */
+static const char    *journalpath;     /* --journal of written shadows, or NULL */
+static FILE          *journal;         /* journalpath, open for appending */
+static Journalentry  *journaled;       /* entries from previous runs, sorted */
+static size_t        journaledcount;   /* number of elements of journaled */
+static pthread_mutex_t journallock = PTHREAD_MUTEX_INITIALIZER; /* guards journal */
+static Covercache    *covercache;      /* --cover-cache, mapped; NULL if none */
+static uint8_t       *cachedata;       /* data area of covercache */
+static _Atomic uint32_t cachehits;     /* covers found in covercache */
+static _Atomic uint32_t cachemisses;   /* covers read from their files */
+static uint32_t      shard;            /* --shard: 1 to shards, SHARD_INIT or SHARD_CHECK */
+static uint32_t      shards;           /* processes sharing the blocks; 0 if not sharded */
 static const uint8_t modinv[PRIME] = { /* modular multiplicative inverse */
     0, 1, 126, 84, 63, 201, 42, 36, 157, 28, 226, 137, 21, 58, 18, 67, 204,
     192, 14, 185, 113, 12, 194, 131, 136, 241, 29, 93, 9, 26, 159, 81, 102,
@@ -119,6 +505,16 @@ static const uint8_t modinv[PRIME] = { /* modular multiplicative inverse */
     215, 209, 50, 188, 167, 125, 250
 };
 
+bool
+issamedir(const char *a, const char *b) {
+    struct stat sa, sb;
+
+    if (stat(a, &sa) || stat(b, &sb))
+        die("stat: error\n");
+
+    return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
 int
 countfiles(const char *dirname) {
     struct dirent *d;
@@ -141,6 +537,12 @@ randint(long int max) {
     return (long) (normalizedrand * (max + 1)); /* returns num in [0, max] */
 }
 
+/* randint() drawing from the caller's erand48() state, leaving rand()'s alone */
+long
+randint48(unsigned short xsubi[3], long max) {
+    return (long) (erand48(xsubi) * (max + 1));
+}
+
 void
 swap(uint8_t *s, uint8_t *t) {
     uint8_t temp;
@@ -153,14 +555,67 @@ swap(uint8_t *s, uint8_t *t) {
 void
 usage(void) {
     die("usage: %s -(d|r) --secret image -k number -w width -h height -s seed"
-            "[-n number] [--dir directory]\n", argv0);
+            "[-n number] [--dir directory] [--raw] [--archive file [--shadows list]] "
+            "[--rows from:to] [--cols from:to] [--progressive] [--preview level] "
+            "[--correct m] [--hedge m] [--delta image] [--out-dir directory] [--name template] "
+            "[--io stdio|pwrite|direct|mmap] [--jobs number] "
+            "[--durability none|fsync|syncfs] [--sink number=type:target] [--verify sample:percent] [--journal file] [--shard init/m|i/m|check/m] [--cover-cache name:megabytes] [--plan] [--timing]\n"
+            "       %s -d --video file -k number [-s seed] [-n number] "
+            "[--dir directory] [--archive file] [--frame-delta] [--out-dir directory] "
+            "[--io stdio|pwrite|direct|mmap] [--durability none|fsync|syncfs] [--journal file] [--timing]\n"
+            "       %s -e number --cover image -k number -w width -h height "
+            "[--dir directory] [--raw] [--out-dir directory] [--name template] "
+            "[--io stdio|pwrite|direct|mmap] [--durability none|fsync|syncfs]\n"
+            "       %s --reshare newk --covers directory -k number -w width "
+            "-h height [-n number] [--dir directory] [--out-dir directory] "
+            "[--name template] [--durability none|fsync|syncfs]\n", argv0, argv0, argv0, argv0);
 }
 
 /* Calculates needed pixelarraysize, accounting for padding.
  * See: https://en.wikipedia.org/wiki/BMP_file_format#Pixel_storage */
 inline uint32_t
 calculatepixelarraysize(uint32_t width, int32_t height) {
-    return ((BITS_PER_PIXEL * width + 31)/32) * 4 * height;
+    return ((BITS_PER_PIXEL * width + 31)/32) * 4 * (uint32_t) abs(height);
+}
+
+/* Pixels of a width x height image, leaving out the padding of its rows.
+ * Those are the bytes shared, whichever way the rows are stored */
+uint32_t
+sharedpixels(uint32_t width, int32_t height) {
+    return width * (uint32_t) abs(height);
+}
+
+/* The sharedpixels() of bp, row after row in the order they're stored. That's
+ * bp's own pixel array if its rows aren't padded; otherwise it's a copy that
+ * the caller frees */
+uint8_t *
+packpixels(const Bitmap *bp) {
+    uint32_t width  = bp->dibheader.width;
+    uint32_t rows   = abs(bp->dibheader.height);
+    uint32_t stride = calculatepixelarraysize(width, 1);
+
+    if (stride == width)
+        return bp->imgpixels;
+
+    uint8_t *packed = xmalloc(sharedpixels(width, rows));
+    for (uint32_t r = 0; r < rows; r++)
+        memcpy(&packed[r * width], &bp->imgpixels[r * stride], width);
+
+    return packed;
+}
+
+/* Undoes packpixels() for rows [first, last) of bp, zeroing their padding */
+void
+unpackrows(Bitmap *bp, const uint8_t *packed, uint32_t first, uint32_t last) {
+    uint32_t width  = bp->dibheader.width;
+    uint32_t stride = calculatepixelarraysize(width, 1);
+
+    if (packed == bp->imgpixels)
+        return;
+    for (uint32_t r = first; r < last; r++) {
+        memcpy(&bp->imgpixels[r * stride], &packed[r * width], width);
+        memset(&bp->imgpixels[r * stride + width], 0, stride - width);
+    }
 }
 
 uint32_t
@@ -211,6 +666,8 @@ newbitmaphelper(uint32_t width, int32_t height, uint16_t seed, uint16_t shadnum,
     Bitmap *bmp = xmalloc(sizeof(*bmp));
 
     bmp->imgpixels = xmalloc(pixelarraysize);
+    bmp->mapping   = NULL;
+    bmp->maplength = 0;
     initpalette(bmp->palette);
 
     bmp->bmpheader = (BMPheader)
@@ -242,7 +699,10 @@ newbitmaphelper(uint32_t width, int32_t height, uint16_t seed, uint16_t shadnum,
 
 void
 freebitmap(Bitmap *bp) {
-    free(bp->imgpixels);
+    if (bp->mapping)
+        xmunmap(bp->mapping, bp->maplength);
+    else
+        free(bp->imgpixels);
     free(bp);
 }
 
@@ -339,7 +799,8 @@ writedibheader(const Bitmap *bp, FILE *fp) {
 
 Bitmap *
 bmpfromfile(const char *filename) {
-    FILE *fp = xfopen(filename, "r");
+    /* the headers are read in order, so - can stream the image from stdin */
+    FILE *fp = strcmp(filename, "-") == 0 ? stdin : xfopen(filename, "r");
     Bitmap *bp = xmalloc(sizeof(*bp));
 
     readbmpheader(bp, fp);
@@ -349,18 +810,21 @@ bmpfromfile(const char *filename) {
     /* read pixel data */
     uint32_t imagesize = bmpimagesize(bp);
     bp->imgpixels = xmalloc(imagesize);
+    bp->mapping   = NULL;
+    bp->maplength = 0;
     xfread(bp->imgpixels, sizeof(bp->imgpixels[0]), imagesize, fp);
-    xfclose(fp);
+    if (fp != stdin)
+        xfclose(fp);
 
     return bp;
 }
 
 bool
 isvalidbmpsize(FILE *fp, uint16_t k, uint32_t secretsize) {
-    uint32_t shadowsize = (secretsize * 8)/k;
+    uint32_t hiddensize = 8 * shadowsize(secretsize, k);
     uint32_t imgsize    = bmpfilewidth(fp) * bmpfileheight(fp);
 
-    return imgsize >= shadowsize;
+    return imgsize >= hiddensize;
 }
 
 bool
@@ -383,13 +847,28 @@ bmpimagesize(const Bitmap *bp) {
 
 void
 bmptofile(const Bitmap *bp, const char *filename) {
-    FILE *fp = xfopen(filename, "w");
+    FILE *fp = strcmp(filename, "-") == 0 ? stdout : xfopen(filename, "w");
 
+    writebmpto(bp, fp);
+    if (fp == stdout)
+        xfflush(fp);
+    else
+        xfclose(fp);
+}
+
+void
+writebmpto(const Bitmap *bp, FILE *fp) {
     writebmpheader(bp, fp);
     writedibheader(bp, fp);
     xfwrite(bp->palette, PALETTE_SIZE, 1, fp);
     xfwrite(bp->imgpixels, bmpimagesize(bp), 1, fp);
-    xfclose(fp);
+}
+
+/* bytes of each shadow of a secret of secretsize bytes: one per section of k
+ * bytes, the last section being zero padded */
+uint32_t
+shadowsize(uint32_t secretsize, uint16_t k) {
+    return ALIGN_UP(secretsize, k) / k;
 }
 
 /* find closest pair of values that when multiplied, give x.
@@ -398,6 +877,8 @@ void
 findclosestpair(uint32_t x, uint32_t *width, int32_t *height) {
     unsigned int y = floor(sqrt(x));
 
+    *width  = x; /* if there's no such pair, use a single row */
+    *height = 1;
     for (; y > 2; y--)
         if (x % y == 0) {
             *width  = y;
@@ -411,24 +892,121 @@ newshadow(uint32_t width, int32_t height, uint16_t seed, uint16_t shadownumber)
     return newbitmaphelper(width, height, seed, shadownumber, width * height);
 }
 
+/* shares blocks sections of k bytes each from data, writing the resulting
+ * pixels from index offset onwards of the n shadows */
+void
+shareblocks(const uint8_t *data, uint32_t blocks, uint16_t k, Bitmap **shadows, uint16_t n, uint32_t offset) {
+    for (size_t j = 0; j < blocks; j++) {
+        const uint8_t *coeff = &data[j*k];
+        for (size_t i = 0; i < n; i++)
+            shadows[i]->imgpixels[offset + j] = generatepixel(coeff, k-1, shadows[i]->bmpheader.unused2);
+    }
+}
+
 Bitmap **
 formshadows(const Bitmap *bp, uint16_t k, uint16_t n, uint16_t seed) {
     uint32_t width;
     int32_t height;
-    uint32_t pixelarraysize = bmpimagesize(bp);
+    uint32_t pixelarraysize = sharedpixels(bp->dibheader.width, bp->dibheader.height);
+    uint8_t *data    = packpixels(bp);
     Bitmap **shadows = xmalloc(sizeof(*shadows) * n);
 
-    findclosestpair(pixelarraysize/k, &width, &height);
+    findclosestpair(shadowsize(pixelarraysize, k), &width, &height);
 
     /* allocate shadows */
     for (size_t i = 0; i < n; i++)
         shadows[i] = newshadow(width, height, seed, i+1);
 
-    /* generate shadow image pixels */
-    for (size_t j = 0; j*k < pixelarraysize; j++) {
-        uint8_t *coeff = &bp->imgpixels[j*k];
-        for (size_t i = 0; i < n; i++)
-            shadows[i]->imgpixels[j] = generatepixel(coeff, k-1, i+1);
+    /* generate shadow image pixels; the last section is zero padded */
+    shareblocks(data, pixelarraysize/k, k, shadows, n, 0);
+    if (pixelarraysize % k) {
+        uint8_t *last = xmalloc(k);
+        memset(last, 0, k);
+        memcpy(last, &data[pixelarraysize - pixelarraysize % k], pixelarraysize % k);
+        shareblocks(last, 1, k, shadows, n, pixelarraysize/k);
+        free(last);
+    }
+    if (data != bp->imgpixels)
+        free(data);
+
+    return shadows;
+}
+
+/* Fills the geometry of each level of the pyramid of a width x height image.
+ * Each level's pixels are zero padded to a multiple of k. Returns the total
+ * bytes needed in each shadow */
+uint32_t
+progressivelevels(uint32_t width, int32_t height, uint16_t k, Level levels[static PROGRESSIVE_LEVELS]) {
+    uint32_t offset = 0;
+    int32_t rows    = abs(height);
+
+    for (size_t l = 0; l < PROGRESSIVE_LEVELS; l++) {
+        uint32_t factor = 1 << (PROGRESSIVE_LEVELS - 1 - l);
+        Level *lp = &levels[l];
+
+        lp->width  = (width + factor - 1) / factor;
+        lp->height = (rows + (int32_t) factor - 1) / (int32_t) factor;
+        if (height < 0) /* rows stay in the same order */
+            lp->height = -lp->height;
+        lp->size   = sharedpixels(lp->width, lp->height);
+        lp->offset = offset;
+        lp->shares = ALIGN_UP(lp->size, k) / k;
+        offset    += lp->shares;
+    }
+
+    return offset;
+}
+
+/* Returns a new bitmap, factor times smaller in each dimension, each pixel
+ * being the mean of the factor x factor pixels of bp it covers */
+Bitmap *
+downsample(const Bitmap *bp, uint32_t factor) {
+    uint32_t width  = bp->dibheader.width;
+    int32_t height  = abs(bp->dibheader.height);
+    uint32_t stride = calculatepixelarraysize(width, 1);
+    int32_t rows    = (height + (int32_t) factor - 1) / (int32_t) factor;
+    Bitmap *small   = newbitmap((width + factor - 1) / factor,
+            bp->dibheader.height < 0 ? -rows : rows, bp->bmpheader.unused1);
+    uint32_t smallstride = calculatepixelarraysize(small->dibheader.width, 1);
+
+    memset(small->imgpixels, 0, bmpimagesize(small));
+    for (uint32_t y = 0; y < (uint32_t) rows; y++) {
+        for (uint32_t x = 0; x < small->dibheader.width; x++) {
+            uint32_t sum = 0, count = 0;
+            for (uint32_t yy = y * factor; yy < (y + 1) * factor && yy < (uint32_t) height; yy++)
+                for (uint32_t xx = x * factor; xx < (x + 1) * factor && xx < width; xx++, count++)
+                    sum += bp->imgpixels[yy * stride + xx];
+            small->imgpixels[y * smallstride + x] = sum / count;
+        }
+    }
+
+    return small;
+}
+
+/* Like formshadows(), but shares every level of the resolution pyramid of bp,
+ * lowest resolution first, so that a preview can be recovered from a prefix of
+ * the shadows */
+Bitmap **
+formprogressiveshadows(const Bitmap *bp, uint16_t k, uint16_t n, uint16_t seed) {
+    Level levels[PROGRESSIVE_LEVELS];
+    uint32_t total = progressivelevels(bp->dibheader.width, bp->dibheader.height, k, levels);
+    Bitmap **shadows = xmalloc(sizeof(*shadows) * n);
+
+    for (size_t i = 0; i < n; i++)
+        shadows[i] = newshadow(total, 1, seed, i+1);
+
+    for (size_t l = 0; l < PROGRESSIVE_LEVELS; l++) {
+        Bitmap *level   = downsample(bp, 1 << (PROGRESSIVE_LEVELS - 1 - l));
+        uint8_t *pixels = packpixels(level);
+        uint8_t *data   = xmalloc((size_t) levels[l].shares * k);
+
+        memset(data, 0, (size_t) levels[l].shares * k);
+        memcpy(data, pixels, levels[l].size);
+        shareblocks(data, levels[l].shares, k, shadows, n, levels[l].offset);
+        free(data);
+        if (pixels != level->imgpixels)
+            free(pixels);
+        freebitmap(level);
     }
 
     return shadows;
@@ -461,227 +1039,3244 @@ findcoefficients(int **mat, uint16_t k) {
     }
 }
 
-Bitmap *
-revealsecret(Bitmap **shadows, uint32_t width, int32_t height, uint16_t k) {
-    uint32_t pixels = (*shadows)->dibheader.pixelarraysize;
-    Bitmap *bmp = newbitmap(width, height, (*shadows)->bmpheader.unused1);
+int **
+newmatrix(size_t rows, size_t cols) {
+    int **mat = xmalloc(sizeof(*mat) * rows);
 
-    int **mat = xmalloc(sizeof(*mat) * k);
-    for (size_t i = 0; i < k; i++)
-        mat[i] = xmalloc(sizeof(**mat) * (k+1));
+    for (size_t i = 0; i < rows; i++)
+        mat[i] = xmalloc(sizeof(**mat) * cols);
 
-    for (size_t i = 0; i < pixels; i++) {
+    return mat;
+}
+
+void
+freematrix(int **mat, size_t rows) {
+    for (size_t i = 0; i < rows; i++)
+        free(mat[i]);
+    free(mat);
+}
+
+/* Fills inv (k x k) with the inverse of the Vandermonde matrix of the shadow
+ * numbers, i.e. the matrix mapping the values of a section polynomial at those
+ * shadow numbers to its coefficients. Computed once per set of shadows, it
+ * turns revealing each section into a matrix-vector product */
+void
+interpolationmatrix(const uint16_t *shadownumbers, uint16_t k, int **inv) {
+    int **mat = newmatrix(k, k+1);
+
+    for (size_t c = 0; c < k; c++) {
         for (size_t j = 0; j < k; j++) {
-            Bitmap *sp = shadows[j];
-            int value = sp->bmpheader.unused2;
+            int value = shadownumbers[j] % PRIME;
             mat[j][0] = 1;
             for (size_t t = 1; t < k; t++) {
                 mat[j][t] = value;
-                value *= sp->bmpheader.unused2;
+                value = (value * shadownumbers[j]) % PRIME;
             }
-            mat[j][k] = sp->imgpixels[i];
+            mat[j][k] = j == c;
         }
         findcoefficients(mat, k);
-        for (size_t j = i * k; j < (i+1) * k; j++) {
-            bmp->imgpixels[j] = mat[j % k][k];
-        }
+        for (size_t j = 0; j < k; j++)
+            inv[j][c] = mat[j][k];
     }
 
-    //unpermutepixels(bmp, sp->bmpheader.unused1);
-
-    for (size_t i = 0; i < k; i++)
-        free(mat[i]);
-    free(mat);
-
-    return bmp;
+    freematrix(mat, k);
 }
 
+/* Fills out (count x k) so that row r maps the values of a section polynomial
+ * at the shadow numbers inv was computed for, to its value at xs[r] */
 void
-hideshadow(Bitmap *bp, const Bitmap *shadow) {
-    char shadowfilename[20] = {0};
-    uint32_t pixels = bmpimagesize(shadow);
-
-    bp->bmpheader.unused1 = shadow->bmpheader.unused1;
-    bp->bmpheader.unused2 = shadow->bmpheader.unused2;
-    xsnprintf(shadowfilename, 20, "shadow%d.bmp", shadow->bmpheader.unused2);
-
-    for (size_t i = 0; i < pixels; i++) {
-        uint8_t byte = shadow->imgpixels[i];
-        for (size_t j = i*8; j < 8*(i+1); j++) {
-            if (byte & 0x80) /* 1000 0000 */
-                RIGHTMOST_BIT_ON(bp->imgpixels[j]);
-            else
-                RIGHTMOST_BIT_OFF(bp->imgpixels[j]);
-            byte <<= 1;
+evaluationmatrix(int **inv, uint16_t k, const uint16_t *xs, size_t count, int **out) {
+    for (size_t r = 0; r < count; r++) {
+        for (size_t c = 0; c < k; c++) {
+            int power = 1, sum = 0;
+            for (size_t t = 0; t < k; t++) {
+                sum = (sum + power * inv[t][c]) % PRIME;
+                power = (power * xs[r]) % PRIME;
+            }
+            out[r][c] = sum;
         }
     }
-    bmptofile(bp, shadowfilename);
 }
 
-/* width and height parameters needed because the image hiding the shadow could
- * be bigger than necessary */
+/* Finds the k pixels of a section, i.e. the coefficients of the section
+ * polynomial, from its values at k different shadow numbers. inv is the
+ * matrix given by interpolationmatrix() for those shadow numbers */
+void
+revealblock(int **inv, const uint8_t *values, uint16_t k, uint8_t *pixels) {
+    for (size_t j = 0; j < k; j++) {
+        const int *row = inv[j];
+        uint32_t sum = 0;
+        for (size_t t = 0; t < k; t++)
+            sum += (uint32_t) row[t] * values[t];
+        pixels[j] = sum % PRIME;
+    }
+}
+
 Bitmap *
-retrieveshadow(const Bitmap *bp, uint32_t width, int32_t height, uint16_t k) {
-    uint16_t key          = bp->bmpheader.unused1;
-    uint16_t shadownumber = bp->bmpheader.unused2;
+revealsecret(Bitmap **shadows, uint32_t width, int32_t height, uint16_t k, int outfd) {
+    uint32_t pixels = (*shadows)->dibheader.pixelarraysize;
+    Bitmap *bmp = newbitmap(width, height, (*shadows)->bmpheader.unused1);
+    uint16_t *shadownumbers = xmalloc(sizeof(*shadownumbers) * k);
+    uint8_t *values = xmalloc(k);
+    int **inv = newmatrix(k, k);
 
-    findclosestpair(calculatepixelarraysize(width, height)/k, &width, &height);
-    Bitmap *shadow = newshadow(width, height, key, shadownumber);
-    uint32_t shadowpixels = shadow->dibheader.pixelarraysize;
+    for (size_t j = 0; j < k; j++)
+        shadownumbers[j] = shadows[j]->bmpheader.unused2;
+    interpolationmatrix(shadownumbers, k, inv);
 
-    for (uint32_t i = 0; i < shadowpixels; i++) {
-        uint8_t byte = 0;
-        uint8_t mask = 0x80; /* 1000 0000 */
-        for (uint32_t j = i*8; j < 8*(i+1); j++) {
-            if (bp->imgpixels[j] & 0x01)
-                byte |= mask;
-            mask >>= 1;
+    /* sections are revealed packed, and rows get their padding back as
+     * they're finished */
+    uint32_t size   = sharedpixels(width, height);
+    uint32_t stride = calculatepixelarraysize(width, 1);
+    uint32_t rows   = abs(height);
+    uint8_t *packed = stride == width ? bmp->imgpixels : xmalloc(size);
+    uint32_t written = 0; /* rows */
+    uint8_t *last = xmalloc(k);
+    for (size_t i = 0; i < pixels && i * k < size; i++) {
+        for (size_t j = 0; j < k; j++)
+            values[j] = shadows[j]->imgpixels[i];
+        if ((i + 1) * k <= size) {
+            revealblock(inv, values, k, &packed[i * k]);
+        } else { /* drop the padding of the last section */
+            revealblock(inv, values, k, last);
+            memcpy(&packed[i * k], last, size - i * k);
+        }
+        /* hand out each finished chunk while the next ones are revealed */
+        uint32_t done = MIN((i + 1) * k, size) / width;
+        if (outfd >= 0 && (done - written) * stride >= STREAM_CHUNK) {
+            unpackrows(bmp, packed, written, done);
+            xwritepipe(outfd, &bmp->imgpixels[written * stride], (done - written) * stride);
+            written = done;
         }
-        shadow->imgpixels[i] = byte;
     }
+    unpackrows(bmp, packed, written, rows);
+    if (outfd >= 0)
+        xwritepipe(outfd, &bmp->imgpixels[written * stride], (rows - written) * stride);
+    if (packed != bmp->imgpixels)
+        free(packed);
+    free(last);
 
-    return shadow;
-}
-
-bool
-isbmp(FILE *fp) {
-    char magicnumber[2];
-    long pos = ftell(fp);
+    //unpermutepixels(bmp, sp->bmpheader.unused1);
 
-    xfseek(fp, 0, SEEK_SET);
-    xfread(magicnumber, sizeof(magicnumber), 1, fp);
-    xfseek(fp, pos, SEEK_SET);
+    freematrix(inv, k);
+    free(values);
+    free(shadownumbers);
 
-    return magicnumber[0] == 'B' && magicnumber[1] == 'M';
+    return bmp;
 }
 
+/* Gauss-Jordan elimination of a rows x (cols+1) augmented matrix under modular
+ * arithmetic. Free variables are set to 0. Returns false if the system has no
+ * solution */
 bool
-isvalidshadow(FILE *fp, uint16_t k, uint32_t secretsize) {
-    uint16_t shadownumber;
-    long pos = ftell(fp);
-
-    xfseek(fp, UNUSED2_OFFSET, SEEK_SET);
-    xfread(&shadownumber, sizeof(shadownumber), 1, fp);
-    xfseek(fp, pos, SEEK_SET);
-
-    return shadownumber && isbmp(fp) && isvalidbmpsize(fp, k, secretsize);
-}
+solvesystem(int **mat, size_t rows, size_t cols, int *solution) {
+    size_t *pivotcol = xmalloc(sizeof(*pivotcol) * rows);
+    size_t rank = 0;
 
-/* the last parameter is ignored, and is only present so that the function
- * prototype can be used with getvalidfilenames() */
-bool
-isvalidbmp(FILE *fp, uint16_t k, uint32_t ignoredparameter) {
-    return isbmp(fp) && kdivisiblesize(fp, k);
-}
+    for (size_t c = 0; c < cols && rank < rows; c++) {
+        size_t p = rank;
+        while (p < rows && mat[p][c] == 0)
+            p++;
+        if (p == rows)
+            continue;
 
-char **
-getvalidfilenames(const char *dir, uint16_t k, uint16_t n, fn isvalid, uint32_t size) {
-    struct dirent *d;
-    FILE *fp;
-    DIR *dp = xopendir(dir);
-    size_t i = 0;
-    char filepath[PATH_MAX] = {0};
-    char **filenames = xmalloc(sizeof(*filenames) * n);
+        int *tmp = mat[p];
+        mat[p] = mat[rank];
+        mat[rank] = tmp;
 
-    while ((d = readdir(dp)) && i < n) {
-        if (d->d_type == DT_REG) {
-            size_t len = xsnprintf(filepath, PATH_MAX, "%.*s/%.*s", DIR_MAX, dir, NAME_MAX, d->d_name);
-            fp = xfopen(filepath, "r");
-            if (isvalid(fp, k, size)) {
-                filenames[i] = xmalloc(len + 1UL);
-                strncpy(filenames[i], filepath, len);
-                filenames[i][len] = '\0'; /* NULL terminate string */
-                i++;
-            }
-            xfclose(fp);
+        int inv = modinv[mat[rank][c]];
+        for (size_t t = c; t <= cols; t++)
+            mat[rank][t] = (mat[rank][t] * inv) % PRIME;
+        for (size_t i = 0; i < rows; i++) {
+            int a = mat[i][c];
+            if (i == rank || !a)
+                continue;
+            for (size_t t = c; t <= cols; t++)
+                mat[i][t] = mod(mat[i][t] - a * mat[rank][t], PRIME);
         }
+        pivotcol[rank++] = c;
     }
-    xclosedir(dp);
 
-    if (i < n)
-        die("not enough valid bmps for a (%d,%d) threshold scheme in dir %s\n", k, n, dir);
-
-    return filenames;
-}
+    bool consistent = true;
+    for (size_t i = rank; i < rows; i++)
+        consistent &= mat[i][cols] == 0;
 
-char **
-getbmpfilenames(const char *dir, uint16_t k, uint16_t n, uint32_t size) {
-    return getvalidfilenames(dir, k, n, isvalidbmp, size);
-}
+    for (size_t c = 0; c < cols; c++)
+        solution[c] = 0;
+    for (size_t i = 0; i < rank; i++)
+        solution[pivotcol[i]] = mat[i][cols];
+    free(pivotcol);
 
-char **
-getshadowfilenames(const char *dir, uint16_t k, uint32_t size) {
-    return getvalidfilenames(dir, k, k, isvalidshadow, size);
+    return consistent;
 }
 
-void
-distributeimage(const char *dir, const char *imgpath, uint16_t k, uint16_t n, uint16_t seed) {
-    Bitmap *bmp, **shadows;
-
-    bmp = bmpfromfile(imgpath);
-    char ** filepaths = getbmpfilenames(dir, k, n, bmpimagesize(bmp));
-    truncategrayscale(bmp);
-    //permutepixels(bmp, seed);
-    shadows = formshadows(bmp, k, n, seed);
-    freebitmap(bmp);
+/* Berlekamp-Welch decoding of a section from its values at m shadow numbers,
+ * up to (m-k)/2 of which may be wrong. mat needs m rows and m+1 columns, and
+ * solution m elements. Returns false if there were too many errors */
+bool
+correctblock(int **mat, int *solution, const uint16_t *shadownumbers, const uint8_t *values, uint16_t m, uint16_t k, uint8_t *pixels) {
+    uint16_t e    = (m - k) / 2;
+    uint16_t nq   = k + e; /* coefficients of Q, of degree < k+e */
+    uint16_t cols = nq + e;
 
-    for (size_t i = 0; i < n; i++) {
-        bmp = bmpfromfile(filepaths[i]);
-        hideshadow(bmp, shadows[i]);
-        freebitmap(bmp);
+    /* Q(x) = y E(x) with E monic of degree e, for each point (x, y) */
+    for (size_t i = 0; i < m; i++) {
+        int x = shadownumbers[i] % PRIME;
+        int y = values[i];
+        int power = 1;
+        for (size_t t = 0; t < nq; t++) {
+            mat[i][t] = power;
+            if (t < e)
+                mat[i][nq + t] = mod(-y * power, PRIME);
+            if (t == e)
+                mat[i][cols] = (y * power) % PRIME;
+            power = (power * x) % PRIME;
+        }
     }
+    if (!solvesystem(mat, m, cols, solution))
+        return false;
 
-    for (size_t i = 0; i < n; i++) {
-        free(filepaths[i]);
-        freebitmap(shadows[i]);
+    /* P = Q / E by long division; E's leading coefficient is 1 */
+    int *q = solution;
+    int *errlocator = &solution[nq];
+    for (int d = nq - 1; d >= e; d--) {
+        int coeff = q[d];
+        q[d] = 0;
+        if (d - e < k)
+            pixels[d - e] = coeff;
+        for (size_t t = 0; t < e; t++)
+            q[d - e + t] = mod(q[d - e + t] - coeff * errlocator[t], PRIME);
     }
-    free(filepaths);
-    free(shadows);
+    for (size_t t = 0; t < e; t++)
+        if (q[t])
+            return false;
+
+    uint16_t errors = 0;
+    for (size_t i = 0; i < m; i++)
+        errors += generatepixel(pixels, k-1, shadownumbers[i]) != values[i];
+
+    return errors <= e;
 }
 
-void
-recoverimage(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k) {
-    Bitmap **shadows = xmalloc(sizeof(*shadows) * k);
+/* Like revealsecret(), but using m > k shadows to correct up to (m-k)/2 wrong
+ * shadows per section. For each shadow, faults gets the number of sections in
+ * which it disagreed with the decoded secret. Sections are first revealed
+ * from the first k shadows and checked against the rest; decoding only runs
+ * where that check fails */
+Bitmap *
+revealcorrecting(Bitmap **shadows, uint16_t m, uint32_t width, int32_t height, uint16_t k, uint32_t *faults) {
+    uint32_t pixels = (*shadows)->dibheader.pixelarraysize;
+    Bitmap *bmp = newbitmap(width, height, (*shadows)->bmpheader.unused1);
+    uint16_t *shadownumbers = xmalloc(sizeof(*shadownumbers) * m);
+    uint8_t *values = xmalloc(m);
+    int **inv   = newmatrix(k, k);
+    int **check = newmatrix(m - k, k);
+    int **mat   = newmatrix(m, m + 1);
+    int *solution = xmalloc(sizeof(*solution) * (m + 1));
 
-    char **filepaths = getshadowfilenames(dir, k, width * height);
-    for (size_t i = 0; i < k; i++) {
-        Bitmap *bp = bmpfromfile(filepaths[i]);
-        shadows[i] = retrieveshadow(bp, width, height, k);
-        freebitmap(bp);
+    for (size_t j = 0; j < m; j++) {
+        shadownumbers[j] = shadows[j]->bmpheader.unused2;
+        faults[j] = 0;
     }
+    interpolationmatrix(shadownumbers, k, inv);
 
-    Bitmap *bmp = revealsecret(shadows, width, height, k);
-    bmptofile(bmp, filename);
-    freebitmap(bmp);
+    /* check[r] maps the first k values to the value at shadow number k+r */
+    evaluationmatrix(inv, k, &shadownumbers[k], m - k, check);
 
-    for (size_t i = 0; i < k; i++) {
-        free(filepaths[i]);
-        freebitmap(shadows[i]);
-    }
-    free(filepaths);
-    free(shadows);
-}
+    uint32_t size   = sharedpixels(width, height);
+    uint8_t *packed = calculatepixelarraysize(width, 1) == width ? bmp->imgpixels : xmalloc(size);
+    uint8_t *last   = xmalloc(k);
+    for (size_t i = 0; i < pixels && i * k < size; i++) {
+        bool consistent = true;
 
+        for (size_t j = 0; j < m; j++)
+            values[j] = shadows[j]->imgpixels[i];
+        for (size_t r = 0; r < m - k && consistent; r++) {
+            uint32_t sum = 0;
+            for (size_t c = 0; c < k; c++)
+                sum += (uint32_t) check[r][c] * values[c];
+            consistent = sum % PRIME == values[k + r];
+        }
 
-void
-truncategrayscale(Bitmap *bp) {
-    uint32_t imgsize = bmpimagesize(bp);
+        uint8_t *section = (i + 1) * k <= size ? &packed[i * k] : last;
+        if (consistent) {
+            revealblock(inv, values, k, section);
+        } else {
+            if (!correctblock(mat, solution, shadownumbers, values, m, k, section))
+                die("section %zu: more than %d wrong shadows, can't correct\n", i, (m - k) / 2);
+            for (size_t j = 0; j < m; j++)
+                faults[j] += generatepixel(section, k-1, shadownumbers[j]) != values[j];
+        }
+        if (section == last) /* drop the padding of the last section */
+            memcpy(&packed[i * k], last, size - i * k);
+    }
+    unpackrows(bmp, packed, 0, abs(height));
+    if (packed != bmp->imgpixels)
+        free(packed);
+    free(last);
+
+    freematrix(mat, m);
+    freematrix(check, m - k);
+    freematrix(inv, k);
+    free(solution);
+    free(values);
+    free(shadownumbers);
 
-    for (size_t i = 0; i < imgsize; i++)
-        if (bp->imgpixels[i] > 250)
-            bp->imgpixels[i] = 250;
+    return bmp;
 }
 
+/* scatters each bit of the count bytes of in over the least significant bit of
+ * 8 consecutive bytes of cover, most significant bit first */
 void
-permutepixels(Bitmap *bp, uint16_t seed) {
-    uint32_t imgsize = bmpimagesize(bp);
-    uint8_t *p  = bp->imgpixels;
-
-    srand(seed);
-    for (uint32_t i = imgsize - 1; i > 1; i--) {
-        long j = randint(i);
-        swap(&p[j], &p[i]);
-    }
+embedbytes(uint8_t *cover, const uint8_t *in, size_t count) {
+    embedbytesto(cover, cover, in, count);
+}
+
+/* Like embedbytes(), but leaving the patched cover bytes in out, which may be
+ * cover itself */
+void
+embedbytesto(uint8_t *out, const uint8_t *cover, const uint8_t *in, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint8_t byte = in[i];
+        for (size_t j = i*8; j < 8*(i+1); j++) {
+            out[j] = cover[j];
+            if (byte & 0x80) /* 1000 0000 */
+                RIGHTMOST_BIT_ON(out[j]);
+            else
+                RIGHTMOST_BIT_OFF(out[j]);
+            byte <<= 1;
+        }
+    }
+}
+
+/* inverse of embedbytes() */
+void
+extractbytes(const uint8_t *cover, uint8_t *out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint8_t byte = 0;
+        uint8_t mask = 0x80; /* 1000 0000 */
+        for (size_t j = i*8; j < 8*(i+1); j++) {
+            if (cover[j] & 0x01)
+                byte |= mask;
+            mask >>= 1;
+        }
+        out[i] = byte;
+    }
+}
+
+void
+hideshadow(Bitmap *bp, const Bitmap *shadow) {
+    char shadowfilename[PATH_MAX];
+
+    shadowpath(shadowfilename, shadow->bmpheader.unused2);
+    hideshadowto(bp, shadow, shadowfilename);
+}
+
+void
+hideshadowto(Bitmap *bp, const Bitmap *shadow, const char *filename) {
+    embedshadow(bp, shadow);
+    writebmp(bp, filename);
+}
+
+/* Every least significant bit bp has in the shadow's range gets overwritten,
+ * so the same cover can be reused to hide further shadows */
+void
+embedshadow(Bitmap *bp, const Bitmap *shadow) {
+    uint32_t pixels = bmpimagesize(shadow);
+
+    bp->bmpheader.unused1 = shadow->bmpheader.unused1;
+    bp->bmpheader.unused2 = shadow->bmpheader.unused2;
+    setshadowcrc(bp, crc32c(0, shadow->imgpixels, pixels), pixels);
+
+    embedbytes(bp->imgpixels, shadow->imgpixels, pixels);
+}
+
+/* The CRC-32C of the shadow hidden in a cover is kept in the reserved bytes
+ * of its first four palette entries, least significant byte first, and the
+ * amount of shadow bytes it hides in those of the next four. 0 means there's
+ * none, as in covers written before they were stored */
+void
+setshadowcrc(Bitmap *bp, uint32_t crc, uint32_t length) {
+    for (size_t i = 0; i < 4; i++) {
+        bp->palette[4 * i + 3]       = crc >> (8 * i);
+        bp->palette[4 * (i + 4) + 3] = length >> (8 * i);
+    }
+}
+
+uint32_t
+getshadowcrc(const Bitmap *bp) {
+    uint32_t crc = 0;
+
+    for (size_t i = 0; i < 4; i++)
+        crc |= (uint32_t) bp->palette[4 * i + 3] << (8 * i);
+
+    return crc;
+}
+
+uint32_t
+getshadowlength(const Bitmap *bp) {
+    uint32_t length = 0;
+
+    for (size_t i = 0; i < 4; i++)
+        length |= (uint32_t) bp->palette[4 * (i + 4) + 3] << (8 * i);
+
+    return length;
+}
+
+/* setshadowcrc() on a shadow file open as fd */
+void
+writeshadowcrc(int fd, uint32_t crc, uint32_t length) {
+    for (size_t i = 0; i < 4; i++) {
+        uint8_t byte = crc >> (8 * i);
+        xpwrite(fd, &byte, 1, CRC_OFFSET + 4 * i);
+        byte = length >> (8 * i);
+        xpwrite(fd, &byte, 1, CRC_OFFSET + 4 * (i + 4));
+    }
+}
+
+/* path of the file for shadow number shadownumber in --out-dir, named after
+ * the --name template */
+void
+shadowpath(char path[static PATH_MAX], uint16_t shadownumber) {
+    int len = xsnprintf(path, PATH_MAX, "%s/", outdir);
+
+    xsnprintf(path + len, PATH_MAX - len, nametemplate, shadownumber);
+}
+
+/* shadowpath() with the extension of the name, if any, replaced by .sss */
+void
+rawshadowpath(char path[static PATH_MAX], uint16_t shadownumber) {
+    shadowpath(path, shadownumber);
+    char *name = strrchr(path, '/') + 1;
+    char *dot  = strrchr(name, '.');
+    size_t len = dot && dot != name ? (size_t) (dot - path) : strlen(path);
+
+    xsnprintf(path + len, PATH_MAX - len, ".sss");
+}
+
+/* The template is used as a printf format, so it must hold exactly one %d */
+void
+parsename(const char *template) {
+    const char *p = strchr(template, '%');
+
+    if (!p || strncmp(p, "%d", 2) || strchr(p + 2, '%') || strchr(template, '/'))
+        die("--name must be a file name with exactly one %%d; was %s\n", template);
+    nametemplate = template;
+}
+
+IOmode
+parseio(const char *mode) {
+    if (strcmp(mode, "stdio") == 0)
+        return IO_STDIO;
+    if (strcmp(mode, "mmap") == 0)
+        return IO_MMAP;
+    if (strcmp(mode, "pwrite") == 0)
+        return IO_PWRITE;
+    if (strcmp(mode, "direct") == 0)
+        return IO_DIRECT;
+    die("--io must be stdio, pwrite, direct or mmap; was %s\n", mode);
+    return IO_STDIO;
+}
+
+/* Serializes the headers and palette of bp, PIXEL_ARRAY_OFFSET bytes */
+void
+bmpheadertobuffer(const Bitmap *bp, uint8_t *buf) {
+    FILE *fp = fmemopen(buf, PIXEL_ARRAY_OFFSET, "w");
+
+    if (!fp)
+        die("fmemopen: error\n");
+    writebmpheader(bp, fp);
+    writedibheader(bp, fp);
+    xfwrite(bp->palette, PALETTE_SIZE, 1, fp);
+    xfclose(fp);
+}
+
+/* Writes bp to filename with the method chosen by --io */
+void
+writebmp(const Bitmap *bp, const char *filename) {
+    uint32_t imagesize = bmpimagesize(bp);
+    uint8_t header[PIXEL_ARRAY_OFFSET];
+
+    if (iomode == IO_STDIO) {
+        FILE *fp = createoutputstream(filename);
+        writebmpto(bp, fp);
+        xfflush(fp);
+        commitoutput(fileno(fp), filename);
+        xfclose(fp);
+    } else if (iomode == IO_MMAP) {
+        int fd;
+        uint8_t *out = createmapped(filename, PIXEL_ARRAY_OFFSET + imagesize, &fd);
+        bmpheadertobuffer(bp, out);
+        memcpy(&out[PIXEL_ARRAY_OFFSET], bp->imgpixels, imagesize);
+        xmunmap(out, PIXEL_ARRAY_OFFSET + imagesize);
+        commitoutput(fd, filename);
+        xclose(fd);
+    } else if (iomode == IO_PWRITE) {
+        bmpheadertobuffer(bp, header);
+        int fd = createoutput(filename, O_WRONLY);
+        xpwrite(fd, header, PIXEL_ARRAY_OFFSET, 0);
+        xpwrite(fd, bp->imgpixels, imagesize, PIXEL_ARRAY_OFFSET);
+        commitoutput(fd, filename);
+        xclose(fd);
+    } else {
+        /* O_DIRECT needs aligned buffers and lengths, so the whole file is
+         * assembled in one buffer and the unaligned tail written without it */
+        size_t length = PIXEL_ARRAY_OFFSET + imagesize;
+        size_t direct = length / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+        uint8_t *buf  = xalignedalloc(DIRECT_ALIGNMENT, ALIGN_UP(length, DIRECT_ALIGNMENT));
+        bmpheadertobuffer(bp, buf);
+        memcpy(&buf[PIXEL_ARRAY_OFFSET], bp->imgpixels, imagesize);
+
+        int fd = createoutput(filename, O_WRONLY | O_DIRECT);
+        xpwrite(fd, buf, direct, 0);
+        if (direct < length) {
+            if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) < 0)
+                die("fcntl: error\n");
+            xpwrite(fd, &buf[direct], length - direct, direct);
+        }
+        commitoutput(fd, filename);
+        xclose(fd);
+        free(buf);
+    }
+}
+
+/* Creates the output filename with length bytes and maps it for writing. The
+ * file is left open in fd for commitoutput() */
+uint8_t *
+createmapped(const char *filename, size_t length, int *fd) {
+    *fd = createoutput(filename, O_RDWR);
+
+    if (ftruncate(*fd, length))
+        die("ftruncate: couldn't resize %s\n", filename);
+
+    return xmmap(length, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+}
+
+/* Outputs are written to .<name>.tmp in the same directory and only renamed
+ * to their name once complete, so readers never see half written files */
+void
+tempname(char tmp[static PATH_MAX], const char *path) {
+    const char *name = strrchr(path, '/');
+
+    name = name ? name + 1 : path;
+    xsnprintf(tmp, PATH_MAX, "%.*s.%s.tmp", (int) (name - path), path, name);
+}
+
+/* Opens the temporary file of the output path with the access mode and
+ * flags given, truncating it. O_DIRECT is dropped on file systems without it */
+int
+createoutput(const char *path, int flags) {
+    char tmp[PATH_MAX];
+
+    tempname(tmp, path);
+    int fd = open(tmp, flags | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 && errno == EINVAL && (flags & O_DIRECT))
+        fd = open(tmp, (flags & ~O_DIRECT) | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        die("open: couldn't open %s\n", tmp);
+
+    return fd;
+}
+
+FILE *
+createoutputstream(const char *path) {
+    FILE *fp = fdopen(createoutput(path, O_WRONLY), "w");
+
+    if (!fp)
+        die("fdopen: error\n");
+
+    return fp;
+}
+
+/* Once the output path, open as fd, is completely written, renames its
+ * temporary file to path. With --durability fsync its data is synced first;
+ * with syncfs the rename waits for syncoutputs() to sync the whole batch */
+void
+commitoutput(int fd, const char *path) {
+    char tmp[PATH_MAX];
+
+    tempname(tmp, path);
+    if (durability == DURABLE_FSYNC) {
+        double start = monotime();
+        if (fdatasync(fd))
+            die("fdatasync: couldn't sync %s\n", tmp);
+        pthread_mutex_lock(&outputlock);
+        synctime += monotime() - start;
+        pthread_mutex_unlock(&outputlock);
+    }
+    if (durability != DURABLE_SYNCFS && rename(tmp, path))
+        die("rename: couldn't rename %s\n", tmp);
+    if (durability != DURABLE_NONE) {
+        pthread_mutex_lock(&outputlock);
+        pending = xrealloc(pending, sizeof(*pending) * (pendingcount + 1));
+        pending[pendingcount++] = xstrdup(path);
+        pthread_mutex_unlock(&outputlock);
+    }
+}
+
+/* Ends a batch of outputs. With --durability syncfs, the file system of each
+ * directory holding outputs is synced once and then the outputs renamed into
+ * place. Then the directories themselves are synced, so the names persist */
+void
+syncoutputs(void) {
+    double start = monotime();
+    char tmp[PATH_MAX], dir[PATH_MAX];
+
+    while (pendingcount) {
+        const char *slash = strrchr(pending[0], '/');
+        size_t dirlength  = slash ? (size_t) (slash - pending[0]) + 1 : 0;
+        if (dirlength > 1)
+            xsnprintf(dir, PATH_MAX, "%.*s", (int) dirlength - 1, pending[0]);
+        else
+            xsnprintf(dir, PATH_MAX, "%s", dirlength ? "/" : ".");
+        int dirfd = xopen(dir, O_RDONLY | O_DIRECTORY);
+
+        if (durability == DURABLE_SYNCFS && syncfs(dirfd))
+            die("syncfs: couldn't sync %s\n", dir);
+        /* commit every output in the same directory */
+        size_t kept = 0;
+        for (size_t i = 0; i < pendingcount; i++) {
+            const char *s = strrchr(pending[i], '/');
+            size_t length = s ? (size_t) (s - pending[i]) + 1 : 0;
+            if (length != dirlength || strncmp(pending[i], pending[0], length)) {
+                pending[kept++] = pending[i];
+                continue;
+            }
+            tempname(tmp, pending[i]);
+            if (durability == DURABLE_SYNCFS && rename(tmp, pending[i]))
+                die("rename: couldn't rename %s\n", tmp);
+            free(pending[i]);
+        }
+        pendingcount = kept;
+
+        if (fsync(dirfd))
+            die("fsync: couldn't sync %s\n", dir);
+        xclose(dirfd);
+    }
+    synctime += monotime() - start;
+}
+
+Durability
+parsedurability(const char *mode) {
+    if (strcmp(mode, "none") == 0)
+        return DURABLE_NONE;
+    if (strcmp(mode, "fsync") == 0)
+        return DURABLE_FSYNC;
+    if (strcmp(mode, "syncfs") == 0)
+        return DURABLE_SYNCFS;
+    die("--durability must be none, fsync or syncfs; was %s\n", mode);
+    return DURABLE_NONE;
+}
+
+/* hideshadowto() for --io mmap: the cover is mapped too, and its pixels are
+ * patched straight into the mapping of the output, so they're copied once */
+void
+hideshadowmapped(const char *coverpath, const Bitmap *shadow, const char *filename) {
+    FILE *fp = xfopen(coverpath, "r");
+    Bitmap header;
+
+    readbmpheader(&header, fp);
+    readdibheader(&header, fp);
+    xfread(header.palette, sizeof(header.palette), 1, fp);
+    header.bmpheader.unused1 = shadow->bmpheader.unused1;
+    header.bmpheader.unused2 = shadow->bmpheader.unused2;
+    setshadowcrc(&header, crc32c(0, shadow->imgpixels, bmpimagesize(shadow)), bmpimagesize(shadow));
+
+    uint32_t imagesize = bmpimagesize(&header);
+    uint32_t hidden    = 8 * bmpimagesize(shadow);
+    size_t length      = PIXEL_ARRAY_OFFSET + imagesize;
+    uint8_t *cover     = xmmap(length, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    int fd;
+    uint8_t *out       = createmapped(filename, length, &fd);
+
+    bmpheadertobuffer(&header, out);
+    embedbytesto(&out[PIXEL_ARRAY_OFFSET], &cover[PIXEL_ARRAY_OFFSET], shadow->imgpixels, hidden / 8);
+    memcpy(&out[PIXEL_ARRAY_OFFSET + hidden], &cover[PIXEL_ARRAY_OFFSET + hidden], imagesize - hidden);
+
+    xmunmap(out, length);
+    commitoutput(fd, filename);
+    xclose(fd);
+    xmunmap(cover, length);
+    xfclose(fp);
+}
+
+/* --sink number=type:target, where type is dir, fifo, unix or exec */
+void
+parsesink(char *spec) {
+    static const char *types[] = {
+        [SINK_DIR] = "dir", [SINK_FIFO] = "fifo", [SINK_UNIX] = "unix", [SINK_EXEC] = "exec"
+    };
+    char *endptr;
+    char *target = strchr(spec, '=');
+    char *colon  = target ? strchr(target, ':') : NULL;
+
+    if (!colon)
+        die("--sink must be number=type:target; was %s\n", spec);
+    *target++ = '\0';
+    *colon    = '\0';
+
+    long int l = xstrtol(spec, &endptr, 10);
+    if (l < 1 || l >= PRIME)
+        die("shadow number must be 1 <= number < %d; was %ld\n", PRIME, l);
+    if (findsink(l))
+        die("shadow %ld has more than one --sink\n", l);
+
+    size_t type = 0;
+    while (type < sizeof(types) / sizeof(types[0]) && strcmp(target, types[type]))
+        type++;
+    if (type == sizeof(types) / sizeof(types[0]))
+        die("--sink type must be dir, fifo, unix or exec; was %s\n", target);
+
+    sinks = xrealloc(sinks, sizeof(*sinks) * (sinkcount + 1));
+    sinks[sinkcount++] = (Sink) { .shadownumber = l, .type = type, .target = colon + 1 };
+}
+
+const Sink *
+findsink(uint16_t shadownumber) {
+    for (size_t i = 0; i < sinkcount; i++)
+        if (sinks[i].shadownumber == shadownumber)
+            return &sinks[i];
+
+    return NULL;
+}
+
+/* Delivers the cover bp, with its shadow embedded, to sink. Streams block
+ * while their reader is slow, which holds back the writer pool and so the
+ * embedding of further covers */
+void
+sendshadow(const Bitmap *bp, const Sink *sink) {
+    uint8_t header[PIXEL_ARRAY_OFFSET];
+    char path[PATH_MAX];
+    int fd;
+
+    if (sink->type == SINK_DIR) {
+        int len = xsnprintf(path, PATH_MAX, "%s/", sink->target);
+        xsnprintf(path + len, PATH_MAX - len, nametemplate, bp->bmpheader.unused2);
+        writebmp(bp, path);
+        return;
+    }
+
+    bmpheadertobuffer(bp, header);
+    if (sink->type == SINK_EXEC) {
+        /* other writers' sink fds are close-on-exec, so this command can't
+         * hold their receivers open */
+        FILE *fp = popen(sink->target, "we");
+        if (!fp)
+            die("popen: couldn't run %s\n", sink->target);
+        xfwrite(header, PIXEL_ARRAY_OFFSET, 1, fp);
+        xfwrite(bp->imgpixels, bmpimagesize(bp), 1, fp);
+        int status = pclose(fp);
+        if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+            die("%s: failed receiving shadow %d\n", sink->target, bp->bmpheader.unused2);
+        return;
+    }
+
+    if (sink->type == SINK_FIFO) {
+        fd = xopen(sink->target, O_WRONLY | O_CLOEXEC);
+    } else {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(sink->target) >= sizeof(addr.sun_path))
+            die("%s: socket path too long\n", sink->target);
+        strcpy(addr.sun_path, sink->target);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+            die("socket: error\n");
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+            die("connect: couldn't connect to %s\n", sink->target);
+    }
+    xwrite(fd, header, PIXEL_ARRAY_OFFSET);
+    xwrite(fd, bp->imgpixels, bmpimagesize(bp));
+    xclose(fd);
+}
+
+/* --cover-cache name:megabytes. Opens the POSIX shared memory object name,
+ * creating it with a data area of the given size if it doesn't exist yet.
+ * Processes given the same name share the covers any of them read */
+void
+opencovercache(const char *spec) {
+    char name[NAME_MAX], *endptr;
+    const char *colon = strrchr(spec, ':');
+
+    if (!colon || colon == spec)
+        die("%s: expected --cover-cache name:megabytes\n", spec);
+    long int megabytes = xstrtol(colon + 1, &endptr, 10);
+    if (megabytes < 1)
+        die("%s: the cache must be at least 1 megabyte\n", spec);
+    xsnprintf(name, sizeof(name), "%s%.*s", spec[0] == '/' ? "" : "/", (int) (colon - spec), spec);
+
+    size_t headersize = ALIGN_UP(sizeof(Covercache), 4096);
+    size_t length     = headersize + ((size_t) megabytes << 20);
+    bool creator      = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        creator = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0)
+        die("shm_open: couldn't open %s\n", name);
+    if (creator && ftruncate(fd, length))
+        die("ftruncate: couldn't size %s\n", name);
+    while (!creator && xfilesize(fd) < (off_t) headersize)
+        sched_yield(); /* its creator is still sizing it */
+    if (!creator) /* the size it was made with wins */
+        length = xfilesize(fd);
+
+    covercache = xmmap(length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    cachedata  = (uint8_t *) covercache + headersize;
+    xclose(fd);
+
+    if (creator) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&covercache->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        covercache->version  = COVER_CACHE_VERSION;
+        covercache->capacity = length - headersize;
+        atomic_store(&covercache->ready, 1);
+    }
+    while (!atomic_load(&covercache->ready))
+        sched_yield();
+    if (covercache->version != COVER_CACHE_VERSION)
+        die("%s: cover cache of another version\n", name);
+}
+
+/* FNV-1a of what tells a file apart, and its contents from an older version */
+uint64_t
+cachekey(const struct stat *st) {
+    uint64_t fields[] = { st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+    const uint8_t *p  = (const uint8_t *) fields;
+    uint64_t hash     = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < sizeof(fields); i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+
+    return hash ? hash : 1; /* 0 marks slots that aren't live */
+}
+
+bool
+isslotof(const Cacheslot *slot, const struct stat *st) {
+    return slot->dev == (uint64_t) st->st_dev && slot->ino == (uint64_t) st->st_ino
+        && slot->size == (uint64_t) st->st_size
+        && slot->mtime == (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/* Returns a private copy of the cover with the given key and identity, or NULL
+ * if it isn't cached. A reader announces itself in readers before checking the
+ * key again, so eviction, which clears the key before checking readers, can't
+ * miss it */
+Bitmap *
+cachedcover(uint64_t key, const struct stat *st) {
+    for (size_t i = 0; i < COVER_CACHE_SLOTS; i++) {
+        Cacheslot *slot = &covercache->slots[i];
+        if (atomic_load(&slot->key) != key)
+            continue;
+        atomic_fetch_add(&slot->readers, 1);
+        if (atomic_load(&slot->key) != key || !isslotof(slot, st)) {
+            atomic_fetch_sub(&slot->readers, 1);
+            continue;
+        }
+
+        const uint8_t *bytes = &cachedata[slot->offset];
+        Bitmap *bp = xmalloc(sizeof(*bp));
+        FILE *fp   = fmemopen((void *) bytes, PIXEL_ARRAY_OFFSET, "r");
+        if (!fp)
+            die("fmemopen: error\n");
+        readbmpheader(bp, fp);
+        readdibheader(bp, fp);
+        xfread(bp->palette, sizeof(bp->palette), 1, fp);
+        xfclose(fp);
+        uint32_t imagesize = bmpimagesize(bp);
+        bp->imgpixels = xmalloc(imagesize);
+        bp->mapping   = NULL;
+        bp->maplength = 0;
+        memcpy(bp->imgpixels, &bytes[bp->bmpheader.offset], imagesize);
+
+        atomic_store(&slot->lastuse, atomic_fetch_add(&covercache->clock, 1));
+        atomic_fetch_sub(&slot->readers, 1);
+        return bp;
+    }
+
+    return NULL;
+}
+
+/* A process that died holding the lock leaves it to the next one */
+void
+lockcache(void) {
+    if (pthread_mutex_lock(&covercache->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&covercache->lock);
+}
+
+/* Under the cache lock, finds the first gap of length bytes in the data area,
+ * evicting the least recently used covers until there is one, and returns a
+ * slot for it in SLOT_FILLING. Returns NULL if the file is being cached
+ * already, or doesn't fit */
+Cacheslot *
+reserveslot(uint64_t length, const struct stat *st) {
+    Cacheslot *slots = covercache->slots;
+
+    if (length > covercache->capacity) /* evicting everything wouldn't help */
+        return NULL;
+    for (;;) {
+        Cacheslot *freeslot = NULL, *victim = NULL;
+        uint64_t offset = 0;
+        bool fits = false;
+
+        for (size_t i = 0; i < COVER_CACHE_SLOTS; i++) {
+            Cacheslot *slot = &slots[i];
+            if (slot->state == SLOT_RETIRED && !atomic_load(&slot->readers))
+                slot->state = SLOT_FREE;
+            /* orphaned by a process that died before making it live */
+            if (slot->state == SLOT_FILLING && kill(slot->filler, 0) == -1 && errno == ESRCH)
+                slot->state = SLOT_FREE;
+            if (slot->state != SLOT_FREE && isslotof(slot, st))
+                return NULL;
+            if (slot->state == SLOT_FREE && !freeslot)
+                freeslot = slot;
+            if (slot->state == SLOT_LIVE && !atomic_load(&slot->readers)
+                    && (!victim || atomic_load(&slot->lastuse) < atomic_load(&victim->lastuse)))
+                victim = slot;
+        }
+        /* first fit: try the start of the area, then the end of each extent */
+        for (size_t i = 0; i <= COVER_CACHE_SLOTS && !fits; i++) {
+            offset = i == 0 ? 0 : slots[i - 1].offset + slots[i - 1].length;
+            if (i > 0 && slots[i - 1].state == SLOT_FREE)
+                continue;
+            fits = offset + length <= covercache->capacity;
+            for (size_t j = 0; j < COVER_CACHE_SLOTS && fits; j++)
+                fits = slots[j].state == SLOT_FREE || slots[j].offset >= offset + length
+                    || slots[j].offset + slots[j].length <= offset;
+        }
+        if (fits && freeslot) {
+            freeslot->state  = SLOT_FILLING;
+            freeslot->filler = getpid();
+            freeslot->offset = offset;
+            freeslot->length = length;
+            freeslot->dev    = st->st_dev;
+            freeslot->ino    = st->st_ino;
+            freeslot->size   = st->st_size;
+            freeslot->mtime  = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+            return freeslot;
+        }
+        if (!victim)
+            return NULL;
+        atomic_store(&victim->key, 0);
+        victim->state = atomic_load(&victim->readers) ? SLOT_RETIRED : SLOT_FREE;
+    }
+}
+
+/* bmpfromfile() for covers, going through the --cover-cache if there's one.
+ * Covers missing from it are read into it, then copied out like hits, so the
+ * cached pixels are never embedded into */
+Bitmap *
+coverfromfile(const char *path) {
+    struct stat st;
+    Bitmap header, *bp;
+
+    if (!covercache)
+        return bmpfromfile(path);
+    FILE *fp = xfopen(path, "r");
+    if (fstat(fileno(fp), &st))
+        die("fstat: error\n");
+    uint64_t key = cachekey(&st);
+    if ((bp = cachedcover(key, &st))) {
+        xfclose(fp);
+        atomic_fetch_add(&cachehits, 1);
+        return bp;
+    }
+
+    atomic_fetch_add(&cachemisses, 1);
+    readbmpheader(&header, fp);
+    readdibheader(&header, fp);
+    uint64_t length = (uint64_t) header.bmpheader.offset + bmpimagesize(&header);
+    Cacheslot *slot = NULL;
+    if (header.bmpheader.offset >= PIXEL_ARRAY_OFFSET && length <= (uint64_t) st.st_size) {
+        lockcache();
+        slot = reserveslot(length, &st);
+        pthread_mutex_unlock(&covercache->lock);
+    }
+    if (!slot) {
+        xfclose(fp);
+        return bmpfromfile(path);
+    }
+
+    xpread(fileno(fp), &cachedata[slot->offset], length, 0);
+    xfclose(fp);
+    atomic_store(&slot->lastuse, atomic_fetch_add(&covercache->clock, 1));
+    lockcache();
+    slot->state = SLOT_LIVE;
+    atomic_store(&slot->key, key);
+    pthread_mutex_unlock(&covercache->lock);
+
+    if (!(bp = cachedcover(key, &st))) /* evicted already */
+        bp = bmpfromfile(path);
+
+    return bp;
+}
+
+/* Worker of the pool distributeimage() hides shadows with. Pops Outputs from
+ * the queue until a NULL one. Each worker holds a single cover at a time */
+void *
+shadowwriter(void *arg) {
+    Queue *queue = arg;
+    Output *output;
+
+    while ((output = queuepop(queue))) {
+        if (isjournaled(0, output->shadow, output->sink ? NULL : output->path)) {
+            free(output);
+            continue;
+        }
+        if (iomode == IO_MMAP && !output->sink) {
+            hideshadowmapped(output->coverpath, output->shadow, output->path);
+        } else {
+            Bitmap *bmp = coverfromfile(output->coverpath);
+            embedshadow(bmp, output->shadow);
+            if (output->sink)
+                sendshadow(bmp, output->sink);
+            else
+                writebmp(bmp, output->path);
+            freebitmap(bmp);
+        }
+        journalshadow(0, output->shadow);
+        free(output);
+    }
+
+    return NULL;
+}
+
+/* width and height parameters needed because the image hiding the shadow could
+ * be bigger than necessary */
+Bitmap *
+retrieveshadow(const Bitmap *bp, uint32_t width, int32_t height, uint16_t k) {
+    uint16_t key          = bp->bmpheader.unused1;
+    uint16_t shadownumber = bp->bmpheader.unused2;
+
+    findclosestpair(shadowsize(sharedpixels(width, height), k), &width, &height);
+    Bitmap *shadow = newshadow(width, height, key, shadownumber);
+
+    extractbytes(bp->imgpixels, shadow->imgpixels, shadow->dibheader.pixelarraysize);
+
+    return shadow;
+}
+
+/* Retrieves the shadow hidden in the BMP at path, checking it against its
+ * length and CRC-32C. Returns NULL, reporting it, if it's truncated or
+ * doesn't match */
+Bitmap *
+loadshadow(const char *path, uint32_t width, int32_t height, uint16_t k) {
+    FILE *fp = xfopen(path, "r");
+    bool whole = iswholebmp(fp);
+
+    xfclose(fp);
+    if (!whole) {
+        fprintf(stderr, "%s: shadow is truncated, skipping it\n", path);
+        return NULL;
+    }
+
+    Bitmap *bp = bmpfromfile(path);
+    Bitmap *shadow  = retrieveshadow(bp, width, height, k);
+    uint32_t crc    = getshadowcrc(bp);
+    uint32_t length = getshadowlength(bp);
+
+    freebitmap(bp);
+    /* the checksum covers all the bytes hidden, which may not be those read */
+    if (length && length != shadow->dibheader.pixelarraysize) {
+        Level levels[PROGRESSIVE_LEVELS];
+        if (length == progressivelevels(width, height, k, levels))
+            fprintf(stderr, "%s: shadow %d is progressive, use --progressive\n", path, shadow->bmpheader.unused2);
+        else
+            fprintf(stderr, "%s: shadow %d hides %u bytes, not the %u of this secret, skipping it\n",
+                    path, shadow->bmpheader.unused2, length, shadow->dibheader.pixelarraysize);
+        freebitmap(shadow);
+        return NULL;
+    }
+    if (crc && crc32c(0, shadow->imgpixels, shadow->dibheader.pixelarraysize) != crc) {
+        fprintf(stderr, "%s: shadow %d fails its checksum, skipping it\n", path, shadow->bmpheader.unused2);
+        freebitmap(shadow);
+        return NULL;
+    }
+
+    return shadow;
+}
+
+void
+changerawendianness(RAWheader *h) {
+    uint16swap(&h->version);
+    uint16swap(&h->seed);
+    uint16swap(&h->shadownumber);
+    uint16swap(&h->k);
+    uint32swap(&h->width);
+    int32swap(&h->height);
+    uint16swap(&h->prime);
+    uint16swap(&h->reserved);
+    uint32swap(&h->checksum);
+    uint32swap(&h->payloadoffset);
+    uint32swap(&h->payloadsize);
+}
+
+/* Reads the header at the current position of fp. Returns false if fp is too
+ * short or doesn't hold a raw shadow container there */
+bool
+readrawheader(RAWheader *h, FILE *fp) {
+    uint8_t buf[RAW_HEADER_SIZE];
+    uint8_t *p = buf;
+
+    if (fread(buf, sizeof(buf), 1, fp) != 1)
+        return false;
+
+#define TAKE(field) (memcpy(&(field), p, sizeof(field)), p += sizeof(field))
+    TAKE(h->magic);
+    TAKE(h->version);
+    TAKE(h->seed);
+    TAKE(h->shadownumber);
+    TAKE(h->k);
+    TAKE(h->width);
+    TAKE(h->height);
+    TAKE(h->prime);
+    TAKE(h->reserved);
+    TAKE(h->checksum);
+    TAKE(h->payloadoffset);
+    TAKE(h->payloadsize);
+#undef TAKE
+
+    if (isbigendian())
+        changerawendianness(h);
+
+    return memcmp(h->magic, RAW_MAGIC, sizeof(h->magic)) == 0
+        && h->version == RAW_VERSION;
+}
+
+void
+writerawheader(const RAWheader *hp, FILE *fp) {
+    RAWheader h = *hp;
+
+    if (isbigendian())
+        changerawendianness(&h);
+
+    xfwrite(h.magic, sizeof(h.magic), 1, fp);
+    xfwrite(&(h.version), sizeof(h.version), 1, fp);
+    xfwrite(&(h.seed), sizeof(h.seed), 1, fp);
+    xfwrite(&(h.shadownumber), sizeof(h.shadownumber), 1, fp);
+    xfwrite(&(h.k), sizeof(h.k), 1, fp);
+    xfwrite(&(h.width), sizeof(h.width), 1, fp);
+    xfwrite(&(h.height), sizeof(h.height), 1, fp);
+    xfwrite(&(h.prime), sizeof(h.prime), 1, fp);
+    xfwrite(&(h.reserved), sizeof(h.reserved), 1, fp);
+    xfwrite(&(h.checksum), sizeof(h.checksum), 1, fp);
+    xfwrite(&(h.payloadoffset), sizeof(h.payloadoffset), 1, fp);
+    xfwrite(&(h.payloadsize), sizeof(h.payloadsize), 1, fp);
+}
+
+/* size of the raw container of a shadow with the given amount of pixels */
+uint32_t
+rawcontainersize(uint32_t pixels) {
+    return RAW_ALIGNMENT + pixels;
+}
+
+/* Writes the shadow pixels as-is (not bit-scattered) after a fixed header,
+ * starting at the current position of fp, which must be RAW_ALIGNMENT aligned.
+ * width and height are those of the secret image */
+void
+writerawshadow(const Bitmap *shadow, uint16_t k, uint32_t width, int32_t height, FILE *fp) {
+    static const uint8_t zeros[RAW_ALIGNMENT - RAW_HEADER_SIZE];
+    uint32_t pixels = bmpimagesize(shadow);
+
+    RAWheader h =
+        { .magic         = RAW_MAGIC
+        , .version       = RAW_VERSION
+        , .seed          = shadow->bmpheader.unused1
+        , .shadownumber  = shadow->bmpheader.unused2
+        , .k             = k
+        , .width         = width
+        , .height        = height
+        , .prime         = PRIME
+        , .reserved      = 0
+        , .checksum      = crc32c(0, shadow->imgpixels, pixels)
+        , .payloadoffset = RAW_ALIGNMENT
+        , .payloadsize   = pixels
+        };
+
+    writerawheader(&h, fp);
+    xfwrite(zeros, sizeof(zeros), 1, fp);
+    xfwrite(shadow->imgpixels, pixels, 1, fp);
+}
+
+void
+shadowtorawfile(const Bitmap *shadow, uint16_t k, uint32_t width, int32_t height, const char *filename) {
+    FILE *fp = createoutputstream(filename);
+
+    writerawshadow(shadow, k, width, height, fp);
+    xfflush(fp);
+    commitoutput(fileno(fp), filename);
+    xfclose(fp);
+}
+
+/* Maps the raw container found at offset base of fp. The returned shadow's
+ * pixels point straight into the mapping; no extraction pass is needed. name
+ * is only used for error messages */
+Bitmap *
+maprawshadow(FILE *fp, off_t base, const char *name, uint16_t k, uint32_t width, int32_t height) {
+    RAWheader h;
+
+    xfseek(fp, base, SEEK_SET);
+    if (!readrawheader(&h, fp))
+        die("%s: not a raw shadow container\n", name);
+    if (h.k != k || h.width != width || h.height != height || h.prime != PRIME)
+        die("%s: shadow was made with k=%d for a %ux%d image\n", name,
+                h.k, h.width, h.height);
+
+    off_t pagestart = base - base % sysconf(_SC_PAGESIZE);
+    size_t length   = (size_t) (base - pagestart) + h.payloadoffset + h.payloadsize;
+    if (h.payloadoffset % RAW_ALIGNMENT || xfilesize(fileno(fp)) < pagestart + (off_t) length)
+        die("%s: truncated or misaligned payload\n", name);
+
+    Bitmap *shadow = xmalloc(sizeof(*shadow));
+    uint32_t shadowwidth;
+    int32_t shadowheight;
+
+    findclosestpair(h.payloadsize, &shadowwidth, &shadowheight);
+    shadow->mapping   = xmmap(length, PROT_READ, MAP_PRIVATE, fileno(fp), pagestart);
+    shadow->maplength = length;
+    shadow->imgpixels = (uint8_t *) shadow->mapping + (base - pagestart) + h.payloadoffset;
+
+    shadow->bmpheader = (BMPheader)
+        { .id[0]   = 'B'
+        , .id[1]   = 'M'
+        , .size    = PIXEL_ARRAY_OFFSET + h.payloadsize
+        , .unused1 = h.seed
+        , .unused2 = h.shadownumber
+        , .offset  = PIXEL_ARRAY_OFFSET
+        };
+    shadow->dibheader = (DIBheader)
+        { .size           = DIB_HEADER_SIZE
+        , .width          = shadowwidth
+        , .height         = shadowheight
+        , .nplanes        = 1
+        , .depth          = BITS_PER_PIXEL
+        , .pixelarraysize = h.payloadsize
+        };
+    initpalette(shadow->palette);
+
+    if (crc32c(0, shadow->imgpixels, h.payloadsize) != h.checksum)
+        die("%s: checksum mismatch\n", name);
+
+    return shadow;
+}
+
+Bitmap *
+shadowfromrawfile(const char *filename, uint16_t k, uint32_t width, int32_t height) {
+    FILE *fp = xfopen(filename, "r");
+    Bitmap *shadow = maprawshadow(fp, 0, filename, k, width, height);
+
+    xfclose(fp);
+
+    return shadow;
+}
+
+bool
+isvalidrawshadow(FILE *fp, uint16_t k, uint32_t secretsize) {
+    RAWheader h;
+    long pos = ftell(fp);
+
+    xfseek(fp, 0, SEEK_SET);
+    bool valid = readrawheader(&h, fp);
+
+    xfseek(fp, pos, SEEK_SET);
+
+    return valid && h.shadownumber && h.k == k
+        && (uint64_t) h.payloadsize * k >= secretsize;
+}
+
+void
+changearchiveendianness(ARCHIVEheader *h, ARCHIVEentry *entries) {
+    for (size_t i = 0; i < h->count; i++) {
+        uint16swap(&entries[i].shadownumber);
+        uint16swap(&entries[i].reserved);
+        uint32swap(&entries[i].size);
+        uint64swap(&entries[i].offset);
+    }
+    uint16swap(&h->version);
+    uint16swap(&h->count);
+}
+
+/* Writes the raw containers of the shadows (or just those in subset) one after
+ * the other into a single file, preceded by an index table, in one sequential
+ * pass */
+void
+shadowstoarchive(Bitmap **shadows, uint16_t n, uint16_t k, uint32_t width, int32_t height, const char *filename) {
+    static const uint8_t zeros[RAW_ALIGNMENT];
+    ARCHIVEheader h = { .magic = ARCHIVE_MAGIC, .version = ARCHIVE_VERSION };
+    ARCHIVEentry *entries = xmalloc(sizeof(*entries) * n);
+    Bitmap **archived = xmalloc(sizeof(*archived) * n);
+
+    for (size_t i = 0; i < n; i++) {
+        bool selected = !subset;
+        for (size_t j = 0; j < subsetsize; j++)
+            selected |= subset[j] == shadows[i]->bmpheader.unused2;
+        if (selected)
+            archived[h.count++] = shadows[i];
+    }
+
+    uint64_t offset = ARCHIVE_HEADER_SIZE + ARCHIVE_ENTRY_SIZE * h.count;
+    for (size_t i = 0; i < h.count; i++) {
+        offset = ALIGN_UP(offset, RAW_ALIGNMENT);
+        entries[i] = (ARCHIVEentry)
+            { .shadownumber = archived[i]->bmpheader.unused2
+            , .reserved     = 0
+            , .size         = rawcontainersize(bmpimagesize(archived[i]))
+            , .offset       = offset
+            };
+        offset += entries[i].size;
+    }
+
+    FILE *fp = createoutputstream(filename);
+    uint64_t written = ARCHIVE_HEADER_SIZE + ARCHIVE_ENTRY_SIZE * h.count;
+    uint16_t count = h.count;
+
+    if (isbigendian())
+        changearchiveendianness(&h, entries);
+    xfwrite(h.magic, sizeof(h.magic), 1, fp);
+    xfwrite(&h.version, sizeof(h.version), 1, fp);
+    xfwrite(&h.count, sizeof(h.count), 1, fp);
+    for (size_t i = 0; i < count; i++) {
+        xfwrite(&entries[i].shadownumber, sizeof(entries[i].shadownumber), 1, fp);
+        xfwrite(&entries[i].reserved, sizeof(entries[i].reserved), 1, fp);
+        xfwrite(&entries[i].size, sizeof(entries[i].size), 1, fp);
+        xfwrite(&entries[i].offset, sizeof(entries[i].offset), 1, fp);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t padding = ALIGN_UP(written, RAW_ALIGNMENT) - written;
+        if (padding)
+            xfwrite(zeros, padding, 1, fp);
+        writerawshadow(archived[i], k, width, height, fp);
+        written += padding + rawcontainersize(bmpimagesize(archived[i]));
+    }
+    xfflush(fp);
+    commitoutput(fileno(fp), filename);
+    xfclose(fp);
+
+    free(archived);
+    free(entries);
+}
+
+/* Maps the first k shadows of the archive */
+void
+shadowsfromarchive(Bitmap **shadows, const char *filename, uint16_t k, uint32_t width, int32_t height) {
+    ARCHIVEheader h;
+    FILE *fp = xfopen(filename, "r");
+
+    if (fread(h.magic, sizeof(h.magic), 1, fp) != 1
+            || memcmp(h.magic, ARCHIVE_MAGIC, sizeof(h.magic)))
+        die("%s: not a shadow archive\n", filename);
+    xfread(&h.version, sizeof(h.version), 1, fp);
+    xfread(&h.count, sizeof(h.count), 1, fp);
+    if (isbigendian()) {
+        uint16swap(&h.version);
+        uint16swap(&h.count);
+    }
+    if (h.version != ARCHIVE_VERSION)
+        die("%s: unsupported archive version %d\n", filename, h.version);
+    if (h.count < k)
+        die("%s: holds %d shadows, %d needed\n", filename, h.count, k);
+
+    ARCHIVEentry *entries = xmalloc(sizeof(*entries) * h.count);
+    for (size_t i = 0; i < h.count; i++) {
+        xfread(&entries[i].shadownumber, sizeof(entries[i].shadownumber), 1, fp);
+        xfread(&entries[i].reserved, sizeof(entries[i].reserved), 1, fp);
+        xfread(&entries[i].size, sizeof(entries[i].size), 1, fp);
+        xfread(&entries[i].offset, sizeof(entries[i].offset), 1, fp);
+    }
+    if (isbigendian()) {
+        ARCHIVEheader swapped = { .count = h.count };
+        changearchiveendianness(&swapped, entries);
+    }
+
+    for (size_t i = 0; i < k; i++) {
+        shadows[i] = maprawshadow(fp, entries[i].offset, filename, k, width, height);
+        if (shadows[i]->bmpheader.unused2 != entries[i].shadownumber)
+            die("%s: index entry %zu doesn't match its container\n", filename, i);
+    }
+    xfclose(fp);
+    free(entries);
+}
+
+/* parses a comma separated list of shadow numbers, e.g. "1,3,5" */
+void
+parsesubset(char *list) {
+    char *endptr;
+
+    subsetsize = 1;
+    for (char *p = list; *p; p++)
+        subsetsize += *p == ',';
+    subset = xmalloc(sizeof(*subset) * subsetsize);
+
+    subsetsize = 0;
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        long int l = xstrtol(tok, &endptr, 10);
+        if (l < 1 || l > UINT16_MAX)
+            die("shadow numbers must be 1 <= number <= %d; was %ld\n", UINT16_MAX, l);
+        subset[subsetsize++] = l;
+    }
+}
+
+bool
+isbmp(FILE *fp) {
+    char magicnumber[2];
+    long pos = ftell(fp);
+
+    xfseek(fp, 0, SEEK_SET);
+    xfread(magicnumber, sizeof(magicnumber), 1, fp);
+    xfseek(fp, pos, SEEK_SET);
+
+    return magicnumber[0] == 'B' && magicnumber[1] == 'M';
+}
+
+/* Whether the BMP open as fp is as long as its headers say, so that
+ * bmpfromfile() can read it whole */
+bool
+iswholebmp(FILE *fp) {
+    Bitmap header;
+    long pos   = ftell(fp);
+    off_t size = xfilesize(fileno(fp));
+
+    if (size < PIXEL_ARRAY_OFFSET)
+        return false;
+    xfseek(fp, 0, SEEK_SET);
+    readbmpheader(&header, fp);
+    readdibheader(&header, fp);
+    xfseek(fp, pos, SEEK_SET);
+
+    return size >= PIXEL_ARRAY_OFFSET + (off_t) bmpimagesize(&header);
+}
+
+bool
+isvalidshadow(FILE *fp, uint16_t k, uint32_t secretsize) {
+    uint16_t shadownumber;
+    long pos = ftell(fp);
+
+    if (xfilesize(fileno(fp)) < PIXEL_ARRAY_OFFSET) /* not even the headers */
+        return false;
+    xfseek(fp, UNUSED2_OFFSET, SEEK_SET);
+    xfread(&shadownumber, sizeof(shadownumber), 1, fp);
+    xfseek(fp, pos, SEEK_SET);
+
+    return shadownumber && isbmp(fp) && isvalidbmpsize(fp, k, secretsize);
+}
+
+/* secretsize is the amount of bytes to share, so the cover must be big enough
+ * to hide a shadow of secretsize/k bytes */
+bool
+isvalidbmp(FILE *fp, uint16_t k, uint32_t secretsize) {
+    return isbmp(fp) && kdivisiblesize(fp, k) && isvalidbmpsize(fp, k, secretsize);
+}
+
+char **
+getvalidfilenames(const char *dir, uint16_t k, uint16_t n, fn isvalid, uint32_t size) {
+    struct dirent *d;
+    FILE *fp;
+    DIR *dp = xopendir(dir);
+    size_t i = 0;
+    char filepath[PATH_MAX] = {0};
+    char **filenames = xmalloc(sizeof(*filenames) * n);
+
+    while ((d = readdir(dp)) && i < n) {
+        if (d->d_type == DT_REG) {
+            size_t len = xsnprintf(filepath, PATH_MAX, "%.*s/%.*s", DIR_MAX, dir, NAME_MAX, d->d_name);
+            fp = xfopen(filepath, "r");
+            if (isvalid(fp, k, size)) {
+                filenames[i] = xmalloc(len + 1UL);
+                strncpy(filenames[i], filepath, len);
+                filenames[i][len] = '\0'; /* NULL terminate string */
+                i++;
+            }
+            xfclose(fp);
+        }
+    }
+    xclosedir(dp);
+
+    if (i < n)
+        die("not enough valid bmps for a (%d,%d) threshold scheme in dir %s\n", k, n, dir);
+
+    return filenames;
+}
+
+char **
+getbmpfilenames(const char *dir, uint16_t k, uint16_t n, uint32_t size) {
+    return getvalidfilenames(dir, k, n, isvalidbmp, size);
+}
+
+char **
+getshadowfilenames(const char *dir, uint16_t k, uint32_t size) {
+    return getwarmfilenames(dir, k, k, isvalidshadow, size);
+}
+
+/* Loads k shadows of dir with loadshadow(), cheapest to read first, skipping
+ * those failing their checksum. Returns the paths of the k loaded */
+char **
+loadshadows(const char *dir, Bitmap **shadows, uint32_t width, int32_t height, uint16_t k) {
+    size_t count, loaded = 0;
+    char **candidates = getrankedfilenames(dir, k, isvalidshadow, sharedpixels(width, height), &count);
+    char **filepaths  = xmalloc(sizeof(*filepaths) * k);
+
+    for (size_t i = 0; i < count; i++) {
+        Bitmap *shadow = loaded < k ? loadshadow(candidates[i], width, height, k) : NULL;
+        if (shadow) {
+            filepaths[loaded] = candidates[i];
+            shadows[loaded++] = shadow;
+        } else {
+            free(candidates[i]);
+        }
+    }
+    free(candidates);
+    if (loaded < k)
+        die("not enough valid shadows for a (%d,%d) threshold scheme in dir %s\n", k, k, dir);
+
+    return filepaths;
+}
+
+/* most resident first, then smallest, then in directory order */
+int
+comparecandidates(const void *a, const void *b) {
+    const Candidatefile *x = a, *y = b;
+
+    if (x->resident != y->resident)
+        return x->resident < y->resident ? 1 : -1;
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/* Like getvalidfilenames(), but when dir holds more than n valid files, picks
+ * the n cheapest to read: those whose part hiding the shadow is in the page
+ * cache (as told by mincore), then the smallest */
+char **
+getwarmfilenames(const char *dir, uint16_t k, uint16_t n, fn isvalid, uint32_t size) {
+    size_t count;
+    char **filenames = getrankedfilenames(dir, k, isvalid, size, &count);
+
+    if (count < n)
+        die("not enough valid bmps for a (%d,%d) threshold scheme in dir %s\n", k, n, dir);
+    for (size_t i = n; i < count; i++)
+        free(filenames[i]);
+
+    return filenames;
+}
+
+/* All count valid files of dir, cheapest to read first as explained above */
+char **
+getrankedfilenames(const char *dir, uint16_t k, fn isvalid, uint32_t size, size_t *count) {
+    struct dirent *d;
+    DIR *dp = xopendir(dir);
+    char filepath[PATH_MAX];
+    Candidatefile *candidates = NULL;
+
+    *count = 0;
+    /* bytes of a shadow BMP read to recover; raw containers are smaller */
+    size_t needed = PIXEL_ARRAY_OFFSET + 8 * (size_t) shadowsize(size, k);
+
+    while ((d = readdir(dp))) {
+        if (d->d_type != DT_REG)
+            continue;
+        xsnprintf(filepath, PATH_MAX, "%.*s/%.*s", DIR_MAX, dir, NAME_MAX, d->d_name);
+        FILE *fp = xfopen(filepath, "r");
+        if (isvalid(fp, k, size)) {
+            off_t filesize = xfilesize(fileno(fp));
+            candidates = xrealloc(candidates, sizeof(*candidates) * (*count + 1));
+            candidates[*count] = (Candidatefile)
+                { .path     = xstrdup(filepath)
+                , .resident = residentfraction(fileno(fp), MIN(needed, (size_t) filesize))
+                , .size     = filesize
+                , .order    = *count
+                };
+            (*count)++;
+        }
+        xfclose(fp);
+    }
+    xclosedir(dp);
+
+    qsort(candidates, *count, sizeof(*candidates), comparecandidates);
+    char **filenames = xmalloc(sizeof(*filenames) * MAX(*count, 1));
+    for (size_t i = 0; i < *count; i++)
+        filenames[i] = candidates[i].path;
+    free(candidates);
+
+    return filenames;
+}
+
+void
+distributeimage(const char *dir, const char *imgpath, uint16_t k, uint16_t n, uint16_t seed) {
+    Bitmap *bmp, **shadows;
+    char **filepaths = NULL;
+    double start = monotime();
+
+    bmp = bmpfromfile(imgpath);
+    uint32_t width = bmp->dibheader.width;
+    int32_t height = bmp->dibheader.height;
+    uint32_t sharedsize = sharedpixels(width, height);
+    if (progressive) {
+        Level levels[PROGRESSIVE_LEVELS];
+        sharedsize = progressivelevels(width, height, k, levels) * k;
+    }
+    if (!archivepath) /* the archive holds the shadows themselves, no covers needed */
+        filepaths = getbmpfilenames(dir, k, n, sharedsize);
+    double readend = monotime();
+    openjournal(k, n, seed, width, height);
+    truncategrayscale(bmp);
+    //permutepixels(bmp, seed);
+    shadows = progressive ? formprogressiveshadows(bmp, k, n, seed) : formshadows(bmp, k, n, seed);
+    double shareend = monotime();
+    if (verifypercent)
+        verifyshadows(bmp, shadows, k, n, verifypercent);
+    freebitmap(bmp);
+
+    if (raw) {
+        char rawfilename[PATH_MAX];
+        for (size_t i = 0; i < n; i++) {
+            rawshadowpath(rawfilename, shadows[i]->bmpheader.unused2);
+            shadowtorawfile(shadows[i], k, width, height, rawfilename);
+        }
+    }
+
+    if (archivepath) {
+        shadowstoarchive(shadows, n, k, width, height, archivepath);
+    } else {
+        /* each cover is read, embedded and written by one of the pool, so at
+         * most jobs of them are in memory at once */
+        size_t workers = MIN(jobs, n);
+        pthread_t *writers = xmalloc(sizeof(*writers) * workers);
+        Queue queue;
+
+        queueinit(&queue, workers);
+        for (size_t i = 0; i < workers; i++)
+            xpthread_create(&writers[i], shadowwriter, &queue);
+        for (size_t i = 0; i < n; i++) {
+            Output *output = xmalloc(sizeof(*output));
+            output->shadow    = shadows[i];
+            output->coverpath = filepaths[i];
+            output->sink      = findsink(shadows[i]->bmpheader.unused2);
+            shadowpath(output->path, shadows[i]->bmpheader.unused2);
+            queuepush(&queue, output);
+        }
+        for (size_t i = 0; i < workers; i++)
+            queuepush(&queue, NULL);
+        for (size_t i = 0; i < workers; i++)
+            xpthread_join(writers[i]);
+        queuefree(&queue);
+        free(writers);
+    }
+    double writeend = monotime();
+    syncoutputs();
+    closejournal();
+
+    if (timing)
+        fprintf(stderr, "read %.3f s, share %.3f s, write %.3f s, sync %.3f s\n",
+                readend - start, shareend - readend, writeend - shareend, synctime);
+    if (timing && covercache)
+        fprintf(stderr, "cover cache: %u hits, %u misses\n", atomic_load(&cachehits), atomic_load(&cachemisses));
+
+    for (size_t i = 0; i < n; i++) {
+        if (filepaths)
+            free(filepaths[i]);
+        freebitmap(shadows[i]);
+    }
+    free(filepaths);
+    free(shadows);
+}
+
+void
+recoverimage(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k) {
+    Bitmap **shadows = xmalloc(sizeof(*shadows) * k);
+
+    char **filepaths = NULL;
+    if (archivepath) {
+        shadowsfromarchive(shadows, archivepath, k, width, height);
+    } else if (raw) {
+        filepaths = getwarmfilenames(dir, k, k, isvalidrawshadow, sharedpixels(width, height));
+        for (size_t i = 0; i < k; i++)
+            shadows[i] = shadowfromrawfile(filepaths[i], k, width, height);
+    } else {
+        /* the k shadows are loaded by up to jobs threads; those failing
+         * their checksum are replaced by the next candidates */
+        Loading loading = { .shadows = shadows, .width = width, .height = height, .k = k };
+        size_t workers = MIN(jobs, k);
+        pthread_t *threads = xmalloc(sizeof(*threads) * workers);
+
+        pthread_mutex_init(&loading.lock, NULL);
+        loading.paths = getrankedfilenames(dir, k, isvalidshadow, sharedpixels(width, height), &loading.count);
+        for (size_t i = 0; i < workers; i++)
+            xpthread_create(&threads[i], shadowloader, &loading);
+        for (size_t i = 0; i < workers; i++)
+            xpthread_join(threads[i]);
+        if (loading.loaded < k)
+            die("not enough valid shadows for a (%d,%d) threshold scheme in dir %s\n", k, k, dir);
+        for (size_t i = 0; i < loading.count; i++)
+            free(loading.paths[i]);
+        free(loading.paths);
+        pthread_mutex_destroy(&loading.lock);
+        free(threads);
+    }
+
+    writerevealed(shadows, width, height, k, filename);
+
+    for (size_t i = 0; i < k; i++) {
+        if (filepaths)
+            free(filepaths[i]);
+        freebitmap(shadows[i]);
+    }
+    free(filepaths);
+    free(shadows);
+}
+
+/* Loads candidates of its Loading while those loaded and being loaded fall
+ * short of k. A loader whose candidate fails its checksum takes the next */
+void *
+shadowloader(void *arg) {
+    Loading *loading = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&loading->lock);
+        const char *path = loading->loaded + loading->pending < loading->k && loading->next < loading->count
+            ? loading->paths[loading->next++] : NULL;
+        loading->pending += path != NULL;
+        pthread_mutex_unlock(&loading->lock);
+        if (!path)
+            break;
+        Bitmap *shadow = loadshadow(path, loading->width, loading->height, loading->k);
+        pthread_mutex_lock(&loading->lock);
+        loading->pending--;
+        if (shadow)
+            loading->shadows[loading->loaded++] = shadow;
+        pthread_mutex_unlock(&loading->lock);
+    }
+
+    return NULL;
+}
+
+/* Measures how many secret bytes per second are shared into n shadows, and
+ * how many shadow bytes per second are embedded into covers, on this machine */
+void
+calibrate(uint16_t k, uint16_t n, double *sharerate, double *embedrate) {
+    uint32_t blocks  = PLAN_CALIBRATION / k;
+    Bitmap **shadows = xmalloc(sizeof(*shadows) * n);
+    uint8_t *data    = xmalloc((size_t) blocks * k);
+    uint8_t *cover   = xmalloc(8 * (size_t) blocks);
+    double start, elapsed;
+    size_t rounds;
+
+    for (size_t i = 0; i < (size_t) blocks * k; i++)
+        data[i] = i % PRIME;
+    for (size_t i = 0; i < n; i++)
+        shadows[i] = newshadow(blocks, 1, 0, i + 1);
+
+    start = monotime();
+    for (rounds = 0; (elapsed = monotime() - start) < 0.02; rounds++)
+        shareblocks(data, blocks, k, shadows, n, 0);
+    *sharerate = rounds * (double) blocks * k / elapsed;
+
+    start = monotime();
+    for (rounds = 0; (elapsed = monotime() - start) < 0.02; rounds++)
+        embedbytes(cover, shadows[0]->imgpixels, blocks);
+    *embedrate = rounds * (double) blocks / elapsed;
+
+    for (size_t i = 0; i < n; i++)
+        freebitmap(shadows[i]);
+    free(shadows);
+    free(cover);
+    free(data);
+}
+
+/* --plan: tells whether the covers of dir can host each secret for (k, n),
+ * which covers -d would use, and how much it would read, write and keep in
+ * memory, and roughly for how long. Only headers are read. Exits with
+ * failure if a secret can't be hosted */
+void
+planbatch(const char *dir, char **secrets, size_t count, uint16_t k, uint16_t n) {
+    struct dirent *d;
+    DIR *dp = xopendir(dir);
+    char filepath[PATH_MAX];
+    Plancover *covers = NULL;
+    size_t ncovers = 0;
+    bool hostable = true;
+    double sharerate, embedrate;
+    double totalread = 0, totalwritten = 0, totaltime = 0, peak = 0;
+    size_t workers = MIN(jobs, n);
+
+    while ((d = readdir(dp))) {
+        if (d->d_type != DT_REG)
+            continue;
+        xsnprintf(filepath, PATH_MAX, "%.*s/%.*s", DIR_MAX, dir, NAME_MAX, d->d_name);
+        FILE *fp = xfopen(filepath, "r");
+        if (xfilesize(fileno(fp)) >= PIXEL_ARRAY_OFFSET && isbmp(fp) && kdivisiblesize(fp, k)) {
+            Bitmap header;
+            readbmpheader(&header, fp);
+            readdibheader(&header, fp);
+            covers = xrealloc(covers, sizeof(*covers) * (ncovers + 1));
+            covers[ncovers++] = (Plancover)
+                { .path      = xstrdup(filepath)
+                , .capacity  = bmpfilewidth(fp) * bmpfileheight(fp)
+                , .imagesize = bmpimagesize(&header)
+                , .size      = xfilesize(fileno(fp))
+                };
+        }
+        xfclose(fp);
+    }
+    xclosedir(dp);
+    calibrate(k, n, &sharerate, &embedrate);
+
+    printf("%zu covers in %s for (%d,%d); sharing %.1f MB/s, embedding %.1f MB/s\n",
+            ncovers, dir, k, n, sharerate / 1e6, embedrate / 1e6);
+    for (size_t s = 0; s < count; s++) {
+        Bitmap header;
+        FILE *fp = xfopen(secrets[s], "r");
+        readbmpheader(&header, fp);
+        readdibheader(&header, fp);
+        double read = xfilesize(fileno(fp));
+        xfclose(fp);
+
+        uint32_t sharedsize = sharedpixels(header.dibheader.width, header.dibheader.height);
+        if (progressive) {
+            Level levels[PROGRESSIVE_LEVELS];
+            sharedsize = progressivelevels(header.dibheader.width, header.dibheader.height, k, levels) * k;
+        }
+        uint32_t shadow = shadowsize(sharedsize, k), width;
+        int32_t height;
+        findclosestpair(shadow, &width, &height);
+        printf("%s: %ux%d, shadows of %ux%d (%u bytes)\n", secrets[s],
+                header.dibheader.width, header.dibheader.height, width, height, shadow);
+
+        /* -d takes the first n covers big enough, in directory order */
+        double written = 0, maxcover = 0;
+        size_t used = 0;
+        for (size_t c = 0; c < ncovers && used < n && !archivepath; c++) {
+            if (covers[c].capacity < 8 * shadow)
+                continue;
+            printf("  shadow %zu in %s\n", used + 1, covers[c].path);
+            read     += covers[c].size;
+            written  += PIXEL_ARRAY_OFFSET + covers[c].imagesize;
+            maxcover  = MAX(maxcover, covers[c].size);
+            used++;
+        }
+        if (!archivepath && used < n) {
+            printf("  can't be hosted: only %zu covers can hide %u bytes\n", used, shadow);
+            hostable = false;
+            continue;
+        }
+        if (raw || archivepath)
+            written += (double) n * rawcontainersize(shadow);
+
+        /* the secret and its shadows, plus a cover per writer */
+        double memory = bmpimagesize(&header) + (double) n * shadow + workers * maxcover;
+        double time   = read / PLAN_READ_RATE + written / PLAN_WRITE_RATE
+            + sharedsize / sharerate + (archivepath ? 0 : (double) n * shadow / embedrate);
+        printf("  read %.2f MB, write %.2f MB, memory %.2f MB, about %.3f s\n",
+                read / 1e6, written / 1e6, memory / 1e6, time);
+        totalread    += read;
+        totalwritten += written;
+        totaltime    += time;
+        peak          = MAX(peak, memory);
+    }
+    printf("total: read %.2f MB, write %.2f MB, peak memory %.2f MB, about %.3f s\n",
+            totalread / 1e6, totalwritten / 1e6, peak / 1e6, totaltime);
+
+    for (size_t c = 0; c < ncovers; c++)
+        free(covers[c].path);
+    free(covers);
+    if (!hostable)
+        exit(EXIT_FAILURE);
+}
+
+/* --journal: each shadow written is recorded as a line "frame number crc", after
+ * a first line naming the distribution. A run given the journal of one with the
+ * same parameters that was cut short skips the shadows it recorded, once
+ * isshadowwritten() checks they made it to disk whole. Nothing happens without
+ * --journal */
+void
+openjournal(uint16_t k, uint16_t n, uint16_t seed, uint32_t width, int32_t height) {
+    char header[128], line[128];
+    bool newline = true;
+    FILE *fp;
+
+    if (!journalpath)
+        return;
+    xsnprintf(header, sizeof(header), "%s %d %d %d %u %d\n", JOURNAL_MAGIC, k, n, seed, width, height);
+    if ((fp = fopen(journalpath, "r"))) {
+        if (!fgets(line, sizeof(line), fp) || strcmp(line, header))
+            die("%s: journal of another distribution\n", journalpath);
+        while (fgets(line, sizeof(line), fp)) {
+            Journalentry e;
+            unsigned number;
+            newline = strchr(line, '\n');
+            /* a line cut short by a crash is left out */
+            if (!newline || sscanf(line, "%u %u %x", &e.frame, &number, &e.crc) != 3)
+                continue;
+            e.shadownumber = number;
+            journaled = xrealloc(journaled, sizeof(*journaled) * (journaledcount + 1));
+            journaled[journaledcount++] = e;
+        }
+        xfclose(fp);
+        qsort(journaled, journaledcount, sizeof(*journaled), comparejournalentries);
+        journal = xfopen(journalpath, "a");
+        if (!newline)
+            fputc('\n', journal);
+    } else {
+        journal = xfopen(journalpath, "w");
+        fputs(header, journal);
+    }
+    xfflush(journal);
+}
+
+void
+closejournal(void) {
+    if (!journal)
+        return;
+    xfclose(journal);
+    free(journaled);
+    journal        = NULL;
+    journaled      = NULL;
+    journaledcount = 0;
+}
+
+int
+comparejournalentries(const void *a, const void *b) {
+    const Journalentry *x = a, *y = b;
+
+    if (x->frame != y->frame)
+        return x->frame < y->frame ? -1 : 1;
+    return (x->shadownumber > y->shadownumber) - (x->shadownumber < y->shadownumber);
+}
+
+/* Whether a previous run journaled shadow as written to path, and it still is
+ * there. Shadows delivered to a --sink, given a NULL path, can't be read back,
+ * so the journal is trusted for them */
+bool
+isjournaled(uint32_t frame, const Bitmap *shadow, const char *path) {
+    if (!journaledcount)
+        return false;
+
+    uint32_t crc = crc32c(0, shadow->imgpixels, bmpimagesize(shadow));
+    Journalentry key = { .frame = frame, .shadownumber = shadow->bmpheader.unused2 };
+    Journalentry *e = bsearch(&key, journaled, journaledcount, sizeof(*journaled), comparejournalentries);
+
+    return e && e->crc == crc && (!path || isshadowwritten(path, shadow, crc));
+}
+
+/* Records shadow as written. Unless --durability is none, the record is synced
+ * too; with syncfs it may then outlive a shadow not yet renamed into place,
+ * which isjournaled() finds missing */
+void
+journalshadow(uint32_t frame, const Bitmap *shadow) {
+    if (!journal)
+        return;
+
+    uint32_t crc = crc32c(0, shadow->imgpixels, bmpimagesize(shadow));
+
+    pthread_mutex_lock(&journallock);
+    fprintf(journal, "%u %d %08x\n", frame, shadow->bmpheader.unused2, crc);
+    xfflush(journal);
+    if (durability != DURABLE_NONE && fdatasync(fileno(journal)))
+        die("fdatasync: couldn't sync %s\n", journalpath);
+    pthread_mutex_unlock(&journallock);
+}
+
+/* Whether the BMP at path is whole and hides shadow: its header carries the
+ * shadow's key, number and CRC-32C, and the bytes hidden in its pixels match */
+bool
+isshadowwritten(const char *path, const Bitmap *shadow, uint32_t crc) {
+    uint32_t pixels = bmpimagesize(shadow);
+    FILE *fp = fopen(path, "r");
+    bool written = false;
+    Bitmap header;
+
+    if (!fp)
+        return false;
+    off_t size = xfilesize(fileno(fp));
+    if (size >= PIXEL_ARRAY_OFFSET && isbmp(fp)) {
+        readbmpheader(&header, fp);
+        readdibheader(&header, fp);
+        xfread(header.palette, sizeof(header.palette), 1, fp);
+        written = size >= PIXEL_ARRAY_OFFSET + (off_t) bmpimagesize(&header)
+            && bmpimagesize(&header) >= 8 * pixels
+            && header.bmpheader.unused1 == shadow->bmpheader.unused1
+            && header.bmpheader.unused2 == shadow->bmpheader.unused2
+            && getshadowcrc(&header) == crc;
+    }
+    if (written) {
+        uint8_t *cover  = xmalloc(8 * (size_t) pixels);
+        uint8_t *hidden = xmalloc(pixels);
+        xpread(fileno(fp), cover, 8 * (size_t) pixels, PIXEL_ARRAY_OFFSET);
+        extractbytes(cover, hidden, pixels);
+        written = crc32c(0, hidden, pixels) == crc;
+        free(hidden);
+        free(cover);
+    }
+    xfclose(fp);
+
+    return written;
+}
+
+/* Checks that the shadows just formed for secret are recoverable, before
+ * they're written. percent of the sections, picked at random, are revealed
+ * from one of VERIFY_SUBSETS random k-subsets of the shadows and compared to
+ * the secret. Dies if any of them doesn't match */
+void
+verifyshadows(const Bitmap *secret, Bitmap **shadows, uint16_t k, uint16_t n, double percent) {
+    uint32_t size    = sharedpixels(secret->dibheader.width, secret->dibheader.height);
+    uint8_t *data    = packpixels(secret);
+    uint32_t blocks  = shadowsize(size, k);
+    uint32_t samples = MAX(1, (uint32_t) (blocks * percent / 100));
+    uint32_t wrong   = 0;
+    uint16_t *order   = xmalloc(sizeof(*order) * n);
+    uint16_t *subsets = xmalloc(sizeof(*subsets) * VERIFY_SUBSETS * k);
+    uint16_t *numbers = xmalloc(sizeof(*numbers) * k);
+    uint8_t *values   = xmalloc(k);
+    uint8_t *section  = xmalloc(k);
+    uint8_t *expected = xmalloc(k);
+    int **inv[VERIFY_SUBSETS];
+    double start = monotime();
+    unsigned long entropy = time(NULL) ^ getpid();
+    unsigned short xsubi[3] = { 0x330E, entropy, entropy >> 16 }; /* as srand48() */
+
+    for (size_t s = 0; s < VERIFY_SUBSETS; s++) {
+        /* the first k of a partial Fisher-Yates shuffle */
+        for (size_t i = 0; i < n; i++)
+            order[i] = i;
+        for (size_t i = 0; i < k; i++) {
+            size_t j = i + randint48(xsubi, n - 1 - i);
+            uint16_t t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+            subsets[s * k + i] = order[i];
+            numbers[i] = shadows[order[i]]->bmpheader.unused2;
+        }
+        inv[s] = newmatrix(k, k);
+        interpolationmatrix(numbers, k, inv[s]);
+    }
+
+    for (uint32_t t = 0; t < samples; t++) {
+        uint32_t b = randint48(xsubi, blocks - 1);
+        size_t s   = randint48(xsubi, VERIFY_SUBSETS - 1);
+        uint32_t len = MIN(k, size - b * k);
+
+        for (size_t j = 0; j < k; j++)
+            values[j] = shadows[subsets[s * k + j]]->imgpixels[b];
+        revealblock(inv[s], values, k, section);
+        memset(expected, 0, k); /* the last section is zero padded */
+        memcpy(expected, &data[b * k], len);
+        wrong += memcmp(section, expected, k) != 0;
+    }
+
+    if (timing)
+        fprintf(stderr, "verified %u of %u sections in %.3f s\n", samples, blocks, monotime() - start);
+    if (wrong)
+        die("verification failed: %u of %u sampled sections can't be recovered\n", wrong, samples);
+
+    for (size_t s = 0; s < VERIFY_SUBSETS; s++)
+        freematrix(inv[s], k);
+    if (data != secret->imgpixels)
+        free(data);
+    free(expected);
+    free(section);
+    free(values);
+    free(numbers);
+    free(subsets);
+    free(order);
+}
+
+/* --verify sample:p, with 0 < p <= 100 */
+double
+parseverify(const char *arg) {
+    char *endptr;
+
+    if (strncmp(arg, "sample:", 7))
+        die("--verify must be sample:percent; was %s\n", arg);
+    double p = strtod(arg + 7, &endptr);
+    if (endptr == arg + 7 || *endptr || !(0 < p && p <= 100))
+        die("--verify percent must be 0 < percent <= 100; was %s\n", arg + 7);
+
+    return p;
+}
+
+/* Reveals the secret hidden in k shadows into filename, or streams it to
+ * stdout if filename is - */
+void
+writerevealed(Bitmap **shadows, uint32_t width, int32_t height, uint16_t k, const char *filename) {
+    Bitmap *bmp;
+    if (strcmp(filename, "-") == 0) {
+        /* stream to stdout: the headers first, then the pixels as revealed */
+        Bitmap *header = newbitmap(width, height, shadows[0]->bmpheader.unused1);
+        writebmpheader(header, stdout);
+        writedibheader(header, stdout);
+        xfwrite(header->palette, PALETTE_SIZE, 1, stdout);
+        xfflush(stdout);
+        freebitmap(header);
+        /* the pixels were vmspliced into the pipe and may still be referenced
+         * by it, so they're left alone until exit */
+        bmp = revealsecret(shadows, width, height, k, STDOUT_FILENO);
+    } else {
+        bmp = revealsecret(shadows, width, height, k, -1);
+        bmptofile(bmp, filename);
+        freebitmap(bmp);
+    }
+}
+
+/* Reads a candidate of a Race, entering its shadow if it's valid and the
+ * race still needs it */
+void *
+hedgedreader(void *arg) {
+    Candidate *c = arg;
+    Race *race   = c->race;
+    Bitmap *shadow = NULL;
+    /* unreadable or truncated candidates just lose, rather than dying */
+    FILE *fp = fopen(c->path, "r");
+
+    if (fp && isvalidshadow(fp, race->k, sharedpixels(race->width, race->height)) && iswholebmp(fp)) {
+        xfclose(fp);
+        shadow = loadshadow(c->path, race->width, race->height, race->k);
+    } else if (fp) {
+        xfclose(fp);
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&race->lock);
+    bool needed = shadow && race->count < race->k;
+    for (size_t i = 0; needed && i < race->count; i++) /* a copy of one already in */
+        needed = race->shadows[i]->bmpheader.unused2 != shadow->bmpheader.unused2;
+    if (needed) {
+        race->latencies[race->count] = monotime() - race->start;
+        race->paths[race->count]     = c->path;
+        race->shadows[race->count++] = shadow;
+        shadow = NULL;
+    }
+    race->finished++;
+    pthread_cond_signal(&race->done);
+    pthread_mutex_unlock(&race->lock);
+
+    if (shadow)
+        freebitmap(shadow);
+
+    return NULL;
+}
+
+/* Recovers from the first k shadows to be read out of the m cheapest valid
+ * shadows of dir, all read concurrently. Once k have arrived the remaining
+ * readers are cancelled and left behind, so a stalled file can't hold up
+ * recovery */
+void
+recoverhedged(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k, uint16_t m) {
+    size_t count;
+    char **paths = getrankedfilenames(dir, k, isvalidshadow, sharedpixels(width, height), &count);
+    size_t candidates = MIN(count, m);
+    /* readers that are still running may touch the race and their candidate
+     * after we're done, so neither is ever freed */
+    Race *race      = xmalloc(sizeof(*race));
+    Candidate *c    = xmalloc(sizeof(*c) * m);
+    pthread_t *readers = xmalloc(sizeof(*readers) * m);
+
+    *race = (Race)
+        { .width     = width
+        , .height    = height
+        , .k         = k
+        , .shadows   = xmalloc(sizeof(*race->shadows) * k)
+        , .paths     = xmalloc(sizeof(*race->paths) * k)
+        , .latencies = xmalloc(sizeof(*race->latencies) * k)
+        , .start     = monotime()
+        };
+    pthread_mutex_init(&race->lock, NULL);
+    pthread_cond_init(&race->done, NULL);
+
+    for (size_t i = 0; i < candidates; i++) {
+        c[i] = (Candidate) { .race = race, .path = paths[i] };
+        xpthread_create(&readers[i], hedgedreader, &c[i]);
+    }
+    for (size_t i = candidates; i < count; i++)
+        free(paths[i]);
+    free(paths);
+
+    pthread_mutex_lock(&race->lock);
+    while (race->count < k && race->finished < candidates)
+        pthread_cond_wait(&race->done, &race->lock);
+    size_t arrived = race->count, finished = race->finished;
+    pthread_mutex_unlock(&race->lock);
+    double elapsed = monotime() - race->start;
+
+    for (size_t i = 0; i < candidates; i++) {
+        pthread_cancel(readers[i]);
+        pthread_detach(readers[i]);
+    }
+    if (arrived < k)
+        die("only %zu valid shadows among %zu files in %s, %d needed\n", arrived, candidates, dir, k);
+
+    if (timing) {
+        for (size_t i = 0; i < k; i++)
+            fprintf(stderr, "%s: shadow %d in %.3f s\n", race->paths[i],
+                    race->shadows[i]->bmpheader.unused2, race->latencies[i]);
+        fprintf(stderr, "%d of %zu shadows in %.3f s: first %.3f s, median %.3f s, "
+                "last %.3f s; %zu readers cancelled\n", k, candidates, elapsed,
+                race->latencies[0], race->latencies[k / 2], race->latencies[k - 1],
+                candidates - finished);
+    }
+
+    writerevealed(race->shadows, width, height, k, filename);
+    free(readers);
+}
+
+/* BMP pixel arrays are stored bottom-up unless the height is negative. Returns
+ * the row of the pixel array holding the given row, counted from the top */
+uint32_t
+filerow(int32_t height, uint32_t row) {
+    return height > 0 ? height - 1 - row : row;
+}
+
+/* Reads the shadow bytes of blocks sections, starting at firstblock, hidden in
+ * each of the k covers. shares[j * blocks + b] gets the byte of section
+ * firstblock + b in cover j */
+void
+readshares(FILE **fps, const uint32_t *offsets, uint16_t k, uint32_t firstblock, uint32_t blocks, uint8_t *shares) {
+    uint8_t *cover = xmalloc(8 * blocks);
+
+    for (size_t j = 0; j < k; j++) {
+        xpread(fileno(fps[j]), cover, 8 * blocks, offsets[j] + 8 * firstblock);
+        extractbytes(cover, &shares[j * blocks], blocks);
+    }
+    free(cover);
+}
+
+/* Hides count shadow bytes, starting at shadow byte first, in the cover
+ * pixels at inoffset of infd, writing the patched pixels to the matching place
+ * of the pixels at outoffset of outfd. Both may be the same file */
+void
+embedrange(int infd, int outfd, uint32_t inoffset, uint32_t outoffset, const uint8_t *shares, uint32_t first, uint32_t count) {
+    uint8_t *cover = xmalloc(8 * count);
+
+    xpread(infd, cover, 8 * count, inoffset + 8 * first);
+    embedbytes(cover, shares, count);
+    xpwrite(outfd, cover, 8 * count, outoffset + 8 * first);
+    free(cover);
+}
+
+/* Reads the bytes hiding sections firstblock to lastblock from each of the k
+ * covers and reveals them into secret */
+void
+revealrun(FILE **fps, const uint32_t *offsets, const uint16_t *shadownumbers, uint16_t k, uint32_t firstblock, uint32_t lastblock, uint8_t *secret) {
+    uint32_t blocks = lastblock - firstblock + 1;
+    uint8_t *shares = xmalloc((size_t) k * blocks);
+    uint8_t *values = xmalloc(k);
+    int **inv = newmatrix(k, k);
+
+    interpolationmatrix(shadownumbers, k, inv);
+    readshares(fps, offsets, k, firstblock, blocks, shares);
+
+    for (size_t b = 0; b < blocks; b++) {
+        for (size_t j = 0; j < k; j++)
+            values[j] = shares[j * blocks + b];
+        revealblock(inv, values, k, &secret[b * k]);
+    }
+
+    freematrix(inv, k);
+    free(values);
+    free(shares);
+}
+
+/* Opens the k shadow files and reads their headers. Returns the seed */
+uint16_t
+openshadowfiles(char **filepaths, uint16_t k, FILE **fps, uint32_t *offsets, uint16_t *shadownumbers) {
+    Bitmap header;
+
+    for (size_t j = 0; j < k; j++) {
+        fps[j] = xfopen(filepaths[j], "r");
+        readbmpheader(&header, fps[j]);
+        offsets[j]       = header.bmpheader.offset;
+        shadownumbers[j] = header.bmpheader.unused2;
+    }
+
+    return header.bmpheader.unused1;
+}
+
+/* Recovers a single level of a progressive distribution. Only the part of the
+ * covers hiding that level is read; for the lowest resolution, that's a small
+ * prefix of each */
+void
+recoverpreview(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k, uint16_t level) {
+    Level levels[PROGRESSIVE_LEVELS];
+    uint32_t total = progressivelevels(width, height, k, levels);
+    char **filepaths = getshadowfilenames(dir, k, total * k);
+    FILE **fps       = xmalloc(sizeof(*fps) * k);
+    uint32_t *offsets        = xmalloc(sizeof(*offsets) * k);
+    uint16_t *shadownumbers  = xmalloc(sizeof(*shadownumbers) * k);
+    Level *lp = &levels[level];
+
+    uint16_t seed = openshadowfiles(filepaths, k, fps, offsets, shadownumbers);
+    for (size_t j = 0; j < k; j++)
+        offsets[j] += 8 * lp->offset;
+
+    uint8_t *secret = xmalloc((size_t) lp->shares * k);
+    revealrun(fps, offsets, shadownumbers, k, 0, lp->shares - 1, secret);
+
+    Bitmap *bmp = newbitmap(lp->width, lp->height, seed);
+    if (calculatepixelarraysize(lp->width, 1) == lp->width)
+        memcpy(bmp->imgpixels, secret, lp->size);
+    else
+        unpackrows(bmp, secret, 0, abs(lp->height));
+    bmptofile(bmp, filename);
+    freebitmap(bmp);
+
+    for (size_t j = 0; j < k; j++) {
+        xfclose(fps[j]);
+        free(filepaths[j]);
+    }
+    free(secret);
+    free(shadownumbers);
+    free(offsets);
+    free(fps);
+    free(filepaths);
+}
+
+/* Recovers only rows [rowfrom, rowto) and columns [colfrom, colto) of the
+ * secret, rows counted from the top. Each section is k contiguous bytes of the
+ * rows, packed, so only the slices of the covers hiding the sections that
+ * intersect the region are read */
+void
+recoverregion(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k,
+        uint32_t rowfrom, uint32_t rowto, uint32_t colfrom, uint32_t colto) {
+    uint32_t stride  = width; /* of the shared pixels, which aren't padded */
+    uint32_t rows    = rowto - rowfrom;
+    uint32_t cols    = colto - colfrom;
+    char **filepaths = getshadowfilenames(dir, k, sharedpixels(width, height));
+    FILE **fps       = xmalloc(sizeof(*fps) * k);
+    uint32_t *offsets        = xmalloc(sizeof(*offsets) * k);
+    uint16_t *shadownumbers  = xmalloc(sizeof(*shadownumbers) * k);
+
+    uint16_t seed = openshadowfiles(filepaths, k, fps, offsets, shadownumbers);
+    Bitmap *bmp = newbitmap(cols, rows, seed);
+    uint32_t outstride = calculatepixelarraysize(cols, 1);
+    uint8_t *secret = xmalloc((size_t) (REGION_CHUNK_BLOCKS + stride / k + 2) * k);
+    memset(bmp->imgpixels, 0, bmpimagesize(bmp));
+
+    /* walk the pixel array rows in file order, grouping consecutive rows whose
+     * sections overlap or touch into a single read */
+    uint32_t lo = height > 0 ? filerow(height, rowto - 1) : rowfrom;
+    uint32_t hi = height > 0 ? filerow(height, rowfrom) : rowto - 1;
+    uint32_t runrow = lo;
+    uint32_t firstblock = (lo * stride + colfrom) / k;
+    uint32_t lastblock  = (lo * stride + colto - 1) / k;
+
+    for (uint32_t fr = lo; fr <= hi; fr++) {
+        uint32_t nextfirst = ((fr + 1) * stride + colfrom) / k;
+        uint32_t nextlast  = ((fr + 1) * stride + colto - 1) / k;
+
+        if (fr < hi && nextfirst <= lastblock + 1 && nextlast - firstblock < REGION_CHUNK_BLOCKS) {
+            lastblock = nextlast;
+            continue;
+        }
+
+        revealrun(fps, offsets, shadownumbers, k, firstblock, lastblock, secret);
+        for (uint32_t r = runrow; r <= fr; r++) {
+            uint32_t row = height > 0 ? height - 1 - r : r; /* row from the top */
+            uint8_t *dst = &bmp->imgpixels[(rows - 1 - (row - rowfrom)) * outstride];
+            memcpy(dst, &secret[r * stride + colfrom - firstblock * k], cols);
+        }
+        runrow     = fr + 1;
+        firstblock = nextfirst;
+        lastblock  = nextlast;
+    }
+
+    bmptofile(bmp, filename);
+    freebitmap(bmp);
+
+    for (size_t j = 0; j < k; j++) {
+        xfclose(fps[j]);
+        free(filepaths[j]);
+    }
+    free(secret);
+    free(shadownumbers);
+    free(offsets);
+    free(fps);
+    free(filepaths);
+}
+
+/* parses "from:to" into the half-open range [from, to) */
+void
+parserange(char *arg, uint32_t *from, uint32_t *to) {
+    char *endptr;
+    char *colon = strchr(arg, ':');
+
+    if (!colon)
+        die("%s: expected a range as from:to\n", arg);
+    *colon = '\0';
+    long int a = xstrtol(arg, &endptr, 10);
+    long int b = xstrtol(colon + 1, &endptr, 10);
+    if (a < 0 || b <= a)
+        die("%ld:%ld: range must be 0 <= from < to\n", a, b);
+    *from = a;
+    *to   = b;
+}
+/* Fills weights with the Lagrange basis polynomials of the k shadow numbers
+ * evaluated at x, so that the value of a section polynomial at x is the
+ * weighted sum of its values at the shadow numbers */
+void
+lagrangeweights(const uint16_t *shadownumbers, uint16_t k, uint16_t x, int *weights) {
+    for (size_t j = 0; j < k; j++) {
+        int num = 1, den = 1;
+        for (size_t i = 0; i < k; i++) {
+            if (i == j)
+                continue;
+            num = (num * mod(x - shadownumbers[i], PRIME)) % PRIME;
+            den = (den * mod(shadownumbers[j] - shadownumbers[i], PRIME)) % PRIME;
+        }
+        weights[j] = (num * modinv[den]) % PRIME;
+    }
+}
+
+/* Makes shadow number shadownumber from k existing shadows, without the
+ * secret, and hides it in the given cover. No other shadow is rewritten */
+void
+extendimage(const char *dir, const char *coverpath, uint32_t width, int32_t height, uint16_t k, uint16_t shadownumber) {
+    uint32_t secretsize = sharedpixels(width, height);
+    Bitmap **shadows  = xmalloc(sizeof(*shadows) * k);
+    uint16_t *shadownumbers = xmalloc(sizeof(*shadownumbers) * k);
+    int *weights = xmalloc(sizeof(*weights) * k);
+    char **filepaths;
+
+    if (raw) {
+        filepaths = getwarmfilenames(dir, k, k, isvalidrawshadow, sharedpixels(width, height));
+        for (size_t i = 0; i < k; i++)
+            shadows[i] = shadowfromrawfile(filepaths[i], k, width, height);
+    } else {
+        filepaths = loadshadows(dir, shadows, width, height, k);
+    }
+
+    for (size_t i = 0; i < k; i++) {
+        shadownumbers[i] = shadows[i]->bmpheader.unused2;
+        if (shadownumbers[i] % PRIME == shadownumber % PRIME)
+            die("%s: shadow %d already exists\n", filepaths[i], shadownumbers[i]);
+    }
+    lagrangeweights(shadownumbers, k, shadownumber, weights);
+
+    FILE *fp = xfopen(coverpath, "r");
+    if (!isvalidbmp(fp, k, secretsize))
+        die("%s: not a BMP able to hide a shadow with k=%d\n", coverpath, k);
+    xfclose(fp);
+
+    Bitmap *shadow = newshadow(shadows[0]->dibheader.width, shadows[0]->dibheader.height,
+            shadows[0]->bmpheader.unused1, shadownumber);
+    uint32_t pixels = bmpimagesize(shadow);
+    for (size_t i = 0; i < pixels; i++) {
+        uint32_t sum = 0;
+        for (size_t j = 0; j < k; j++)
+            sum += (uint32_t) weights[j] * shadows[j]->imgpixels[i];
+        shadow->imgpixels[i] = sum % PRIME;
+    }
+
+    if (iomode == IO_MMAP) {
+        char shadowfilename[PATH_MAX];
+        shadowpath(shadowfilename, shadownumber);
+        hideshadowmapped(coverpath, shadow, shadowfilename);
+    } else {
+        Bitmap *cover = coverfromfile(coverpath);
+        hideshadow(cover, shadow);
+        freebitmap(cover);
+    }
+    syncoutputs();
+    freebitmap(shadow);
+
+    for (size_t i = 0; i < k; i++) {
+        free(filepaths[i]);
+        freebitmap(shadows[i]);
+    }
+    free(filepaths);
+    free(weights);
+    free(shadownumbers);
+    free(shadows);
+}
+
+/* Parses the stream header of a YUV4MPEG2 file. Only the luma plane of each
+ * frame is shared; chromasize gets the size of the planes to skip */
+bool
+ready4mheader(FILE *fp, uint32_t *width, int32_t *height, size_t *chromasize) {
+    char line[Y4M_LINE_MAX];
+    char *endptr;
+    const char *colorspace = "420";
+
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, Y4M_MAGIC, strlen(Y4M_MAGIC)))
+        return false;
+
+    *width  = 0;
+    *height = 0;
+    for (char *tok = strtok(line + strlen(Y4M_MAGIC), " \n"); tok; tok = strtok(NULL, " \n")) {
+        if (tok[0] == 'W')
+            *width = strtoul(tok + 1, &endptr, 10);
+        else if (tok[0] == 'H')
+            *height = strtol(tok + 1, &endptr, 10);
+        else if (tok[0] == 'C')
+            colorspace = tok + 1;
+    }
+    if (!*width || *height <= 0)
+        return false;
+
+    size_t cw = (*width + 1) / 2, ch = (*height + 1) / 2;
+    if (strncmp(colorspace, "mono", 4) == 0)
+        *chromasize = 0;
+    else if (strncmp(colorspace, "420", 3) == 0)
+        *chromasize = 2 * cw * ch;
+    else if (strcmp(colorspace, "422") == 0)
+        *chromasize = 2 * cw * *height;
+    else if (strcmp(colorspace, "444") == 0)
+        *chromasize = 2 * (size_t) *width * *height;
+    else if (strcmp(colorspace, "444alpha") == 0)
+        *chromasize = 3 * (size_t) *width * *height;
+    else
+        die("unsupported Y4M colorspace C%s\n", colorspace);
+
+    return true;
+}
+
+/* Returns the luma plane of the next frame, or NULL at the end of the
+ * stream. Y4M frames are stored top-down, so rows are flipped */
+Bitmap *
+readframe(FILE *fp, uint32_t width, int32_t height, size_t chromasize, uint16_t seed) {
+    char line[Y4M_LINE_MAX];
+
+    if (!fgets(line, sizeof(line), fp))
+        return NULL;
+    if (strncmp(line, "FRAME", 5))
+        die("Y4M: expected a FRAME header\n");
+
+    Bitmap *bmp = newbitmap(width, height, seed);
+    uint32_t stride = calculatepixelarraysize(width, 1);
+
+    memset(bmp->imgpixels, 0, bmpimagesize(bmp));
+    for (int32_t r = 0; r < abs(height); r++)
+        xfread(&bmp->imgpixels[filerow(height, r) * stride], width, 1, fp);
+    for (size_t skipped = 0; skipped < chromasize; ) {
+        uint8_t buf[1 << 14];
+        size_t count = MIN(sizeof(buf), chromasize - skipped);
+        xfread(buf, count, 1, fp);
+        skipped += count;
+    }
+
+    return bmp;
+}
+
+/* Like formshadows(), but if prev is given, sections equal in prev reuse the
+ * shares kept in prevshares instead of being shared again. prevshares is then
+ * updated with the shares of bp */
+Bitmap **
+shareframe(const Bitmap *bp, const Bitmap *prev, uint8_t **prevshares, uint16_t k, uint16_t n, uint16_t seed) {
+    uint32_t size = sharedpixels(bp->dibheader.width, bp->dibheader.height);
+    Bitmap **shadows;
+
+    if (!prev) {
+        shadows = formshadows(bp, k, n, seed);
+    } else {
+        uint8_t *data     = packpixels(bp);
+        uint8_t *prevdata = packpixels(prev);
+        uint8_t *section  = xmalloc(k);
+        uint32_t blocks  = shadowsize(size, k);
+
+        shadows = xmalloc(sizeof(*shadows) * n);
+        for (size_t i = 0; i < n; i++)
+            shadows[i] = newshadow(blocks, 1, seed, i+1);
+        for (uint32_t b = 0; b < blocks; b++) {
+            uint32_t len = MIN(k, size - b * k);
+            if (memcmp(&data[b * k], &prevdata[b * k], len) == 0) {
+                for (size_t i = 0; i < n; i++)
+                    shadows[i]->imgpixels[b] = prevshares[i][b];
+                continue;
+            }
+            memset(section, 0, k);
+            memcpy(section, &data[b * k], len);
+            for (size_t i = 0; i < n; i++)
+                shadows[i]->imgpixels[b] = generatepixel(section, k-1, i+1);
+        }
+        if (data != bp->imgpixels)
+            free(data);
+        if (prevdata != prev->imgpixels)
+            free(prevdata);
+        free(section);
+    }
+
+    for (size_t i = 0; i < n && prevshares; i++)
+        memcpy(prevshares[i], shadows[i]->imgpixels, shadowsize(size, k));
+
+    return shadows;
+}
+
+/* first pipeline stage: reads frames and queues them for sharing */
+void *
+videoreader(void *arg) {
+    Video *v = arg;
+    Bitmap *bmp;
+
+    for (uint32_t index = 0; (bmp = readframe(v->fp, v->width, v->height, v->chromasize, v->seed)); index++) {
+        Frame *frame = xmalloc(sizeof(*frame));
+        *frame = (Frame) { .index = index, .bmp = bmp, .readtime = monotime() };
+        queuepush(&v->read, frame);
+    }
+    queuepush(&v->read, NULL);
+
+    return NULL;
+}
+
+/* second pipeline stage: shares frames and queues them for writing */
+void *
+videosharer(void *arg) {
+    Video *v = arg;
+    Frame *frame;
+    Bitmap *prev = NULL;
+    uint8_t **prevshares = NULL;
+    uint32_t size = sharedpixels(v->width, v->height);
+
+    if (v->delta) {
+        prevshares = xmalloc(sizeof(*prevshares) * v->n);
+        for (size_t i = 0; i < v->n; i++)
+            prevshares[i] = xmalloc(shadowsize(size, v->k));
+    }
+
+    while ((frame = queuepop(&v->read))) {
+        truncategrayscale(frame->bmp);
+        frame->shadows = shareframe(frame->bmp, prev, prevshares, v->k, v->n, v->seed);
+        if (prev)
+            freebitmap(prev);
+        prev = NULL;
+        if (v->delta)
+            prev = frame->bmp;
+        else
+            freebitmap(frame->bmp);
+        frame->bmp = NULL;
+        queuepush(&v->shared, frame);
+    }
+    queuepush(&v->shared, NULL);
+
+    if (prev)
+        freebitmap(prev);
+    for (size_t i = 0; v->delta && i < v->n; i++)
+        free(prevshares[i]);
+    free(prevshares);
+
+    return NULL;
+}
+
+/* Distributes each luma frame of a Y4M stream (a file, or - for stdin) as its
+ * own secret. Reading, sharing and writing run as a pipeline with at most
+ * VIDEO_QUEUE_DEPTH frames waiting between stages. Frame f's shadow i is hidden
+ * in cover (i + f) mod n, so covers rotate between shadow numbers, and written
+ * as shadow<i>_<f>.bmp. With --archive, each frame is archived instead */
+void
+distributevideo(const char *dir, const char *path, uint16_t k, uint16_t n, uint16_t seed, bool delta) {
+    Video v = { .k = k, .n = n, .seed = seed, .delta = delta };
+    Bitmap **covers = NULL;
+    char filename[PATH_MAX];
+    pthread_t reader, sharer;
+    Frame *frame;
+    double start = monotime(), maxlatency = 0, sumlatency = 0;
+    uint32_t frames = 0;
+
+    v.fp = strcmp(path, "-") == 0 ? stdin : xfopen(path, "r");
+    if (!ready4mheader(v.fp, &v.width, &v.height, &v.chromasize))
+        die("%s: not a YUV4MPEG2 stream\n", path);
+
+    uint32_t size = sharedpixels(v.width, v.height);
+    if (!archivepath) {
+        char **filepaths = getbmpfilenames(dir, k, n, size);
+        covers = xmalloc(sizeof(*covers) * n);
+        for (size_t i = 0; i < n; i++) {
+            covers[i] = coverfromfile(filepaths[i]);
+            free(filepaths[i]);
+        }
+        free(filepaths);
+    }
+
+    openjournal(k, n, seed, v.width, v.height);
+    queueinit(&v.read, VIDEO_QUEUE_DEPTH);
+    queueinit(&v.shared, VIDEO_QUEUE_DEPTH);
+    xpthread_create(&reader, videoreader, &v);
+    xpthread_create(&sharer, videosharer, &v);
+
+    while ((frame = queuepop(&v.shared))) {
+        if (archivepath) {
+            xsnprintf(filename, sizeof(filename), "%s.%06u", archivepath, frame->index);
+            shadowstoarchive(frame->shadows, n, k, v.width, v.height, filename);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (!archivepath) {
+                xsnprintf(filename, sizeof(filename), "%s/shadow%d_%06u.bmp", outdir,
+                        frame->shadows[i]->bmpheader.unused2, frame->index);
+                if (!isjournaled(frame->index, frame->shadows[i], filename)) {
+                    hideshadowto(covers[(i + frame->index) % n], frame->shadows[i], filename);
+                    journalshadow(frame->index, frame->shadows[i]);
+                }
+            }
+            freebitmap(frame->shadows[i]);
+        }
+        syncoutputs();
+
+        double latency = monotime() - frame->readtime;
+        maxlatency  = MAX(maxlatency, latency);
+        sumlatency += latency;
+        frames++;
+        free(frame->shadows);
+        free(frame);
+    }
+
+    xpthread_join(sharer);
+    xpthread_join(reader);
+    closejournal();
+    queuefree(&v.shared);
+    queuefree(&v.read);
+    if (v.fp != stdin)
+        xfclose(v.fp);
+    for (size_t i = 0; covers && i < n; i++)
+        freebitmap(covers[i]);
+    free(covers);
+
+    if (timing) {
+        double elapsed = monotime() - start;
+        fprintf(stderr, "%u frames in %.3f s: %.2f frames/s, latency mean %.3f s max %.3f s\n",
+                frames, elapsed, frames / elapsed, frames ? sumlatency / frames : 0, maxlatency);
+    }
+}
+
+/* Updates an existing distribution of oldpath, whose n shadows are in dir, to
+ * share imgpath instead. Only sections that differ between both secrets are
+ * shared again, and only the cover bytes hiding them are rewritten, in place */
+void
+deltaimage(const char *dir, const char *imgpath, const char *oldpath, uint16_t k, uint16_t n) {
+    Bitmap *bmp = bmpfromfile(imgpath);
+    Bitmap *old = bmpfromfile(oldpath);
+    uint32_t width  = bmp->dibheader.width;
+    int32_t height  = bmp->dibheader.height;
+    uint32_t size   = sharedpixels(width, height);
+    uint32_t blocks = shadowsize(size, k);
+
+    if (old->dibheader.width != width || old->dibheader.height != height)
+        die("%s and %s must have the same dimensions\n", imgpath, oldpath);
+    truncategrayscale(bmp);
+    truncategrayscale(old);
+    uint8_t *data    = packpixels(bmp);
+    uint8_t *olddata = packpixels(old);
+
+    char **filepaths = getvalidfilenames(dir, k, n, isvalidshadow, size);
+    FILE **fps = xmalloc(sizeof(*fps) * n);
+    uint32_t *offsets       = xmalloc(sizeof(*offsets) * n);
+    uint16_t *shadownumbers = xmalloc(sizeof(*shadownumbers) * n);
+    uint8_t *shares  = xmalloc((size_t) n * REGION_CHUNK_BLOCKS);
+    uint8_t *section = xmalloc(k);
+    bool changed     = false;
+    Bitmap header;
+
+    for (size_t i = 0; i < n; i++) {
+        fps[i] = xfopen(filepaths[i], "r+");
+        readbmpheader(&header, fps[i]);
+        offsets[i]       = header.bmpheader.offset;
+        shadownumbers[i] = header.bmpheader.unused2;
+    }
+
+    for (uint32_t b = 0; b < blocks; ) {
+        uint32_t len = MIN(k, size - b * k);
+        if (memcmp(&data[b * k], &olddata[b * k], len) == 0) {
+            b++;
+            continue;
+        }
+
+        /* share the run of changed sections starting at b */
+        uint32_t first = b;
+        for (; b < blocks && b - first < REGION_CHUNK_BLOCKS; b++) {
+            len = MIN(k, size - b * k);
+            if (memcmp(&data[b * k], &olddata[b * k], len) == 0)
+                break;
+            memset(section, 0, k);
+            memcpy(section, &data[b * k], len);
+            for (size_t i = 0; i < n; i++)
+                shares[i * REGION_CHUNK_BLOCKS + b - first] = generatepixel(section, k-1, shadownumbers[i]);
+        }
+        for (size_t i = 0; i < n; i++)
+            embedrange(fileno(fps[i]), fileno(fps[i]), offsets[i], offsets[i],
+                    &shares[i * REGION_CHUNK_BLOCKS], first, b - first);
+        changed = true;
+    }
+
+    /* the checksums cover the whole shadows, so they're computed again from
+     * the updated files */
+    uint32_t *crcs = xmalloc(sizeof(*crcs) * n);
+    for (size_t i = 0; i < n; i++)
+        crcs[i] = 0;
+    for (uint32_t first = 0; changed && first < blocks; first += REGION_CHUNK_BLOCKS) {
+        uint32_t count = MIN(REGION_CHUNK_BLOCKS, blocks - first);
+        readshares(fps, offsets, n, first, count, shares);
+        for (size_t i = 0; i < n; i++)
+            crcs[i] = crc32c(crcs[i], &shares[i * count], count);
+    }
+    for (size_t i = 0; changed && i < n; i++)
+        writeshadowcrc(fileno(fps[i]), crcs[i], blocks);
+    free(crcs);
+
+    for (size_t i = 0; i < n; i++) {
+        /* updated in place, so there's no rename; only the data is synced */
+        if (durability != DURABLE_NONE && fdatasync(fileno(fps[i])))
+            die("fdatasync: couldn't sync %s\n", filepaths[i]);
+        xfclose(fps[i]);
+        free(filepaths[i]);
+    }
+    free(section);
+    free(shares);
+    free(shadownumbers);
+    free(offsets);
+    free(fps);
+    free(filepaths);
+    if (olddata != old->imgpixels)
+        free(olddata);
+    if (data != bmp->imgpixels)
+        free(data);
+    freebitmap(old);
+    freebitmap(bmp);
+}
+
+/* --shard init/m, i/m or check/m. Shards are numbered from 1 */
+void
+parseshard(const char *arg) {
+    char *endptr;
+    const char *slash = strchr(arg, '/');
+
+    if (!slash)
+        die("%s: expected --shard init/m, i/m or check/m\n", arg);
+    long int m = xstrtol(slash + 1, &endptr, 10);
+    if (m < 1 || m > UINT16_MAX)
+        die("%s: shards must be 1 <= m <= %d\n", arg, UINT16_MAX);
+    if (strncmp(arg, "init/", 5) == 0) {
+        shard = SHARD_INIT;
+    } else if (strncmp(arg, "check/", 6) == 0) {
+        shard = SHARD_CHECK;
+    } else {
+        char index[16];
+        xsnprintf(index, sizeof(index), "%.*s", (int) MIN(slash - arg, 15), arg);
+        long int i = xstrtol(index, &endptr, 10);
+        if (i < 1 || i > m)
+            die("%s: shard must be 1 <= i <= m\n", arg);
+        shard = i;
+    }
+    shards = m;
+}
+
+/* path of the file a shard leaves in --out-dir once its blocks are written */
+void
+shardmarker(char path[static PATH_MAX], uint32_t index) {
+    xsnprintf(path, PATH_MAX, "%s/.shard%u-of-%u", outdir, index, shards);
+}
+
+/* [first, last) are the blocks of shard index, out of shards contiguous ranges
+ * as even as can be */
+void
+shardrange(uint32_t blocks, uint32_t index, uint32_t *first, uint32_t *last) {
+    *first = (uint64_t) blocks * (index - 1) / shards;
+    *last  = (uint64_t) blocks * index / shards;
+}
+
+/* Reads count of the sharedpixels() of the secret open as fd, starting at
+ * from, as packpixels() would lay them out, clamped as by truncategrayscale().
+ * Past the last pixel, out is zero padded */
+void
+readsecretslice(int fd, const Bitmap *header, uint32_t from, uint32_t count, uint8_t *out) {
+    uint32_t width  = header->dibheader.width;
+    uint32_t stride = calculatepixelarraysize(width, 1);
+    uint32_t size   = sharedpixels(width, header->dibheader.height);
+    uint32_t valid  = from < size ? MIN(count, size - from) : 0;
+
+    for (uint32_t done = 0; done < valid; ) {
+        uint32_t p   = from + done;
+        uint32_t len = MIN(width - p % width, valid - done);
+        xpread(fd, &out[done], len, header->bmpheader.offset + (off_t) (p / width) * stride + p % width);
+        done += len;
+    }
+    memset(&out[valid], 0, count - valid);
+    for (uint32_t i = 0; i < valid; i++)
+        if (out[i] > 250)
+            out[i] = 250;
+}
+
+/* Opens the n outputs shardinit() made, checking they can hold blocks */
+void
+openshardoutputs(uint16_t n, uint32_t blocks, FILE **fps, uint32_t *offsets, uint16_t *shadownumbers) {
+    char path[PATH_MAX];
+    Bitmap header;
+
+    for (size_t i = 0; i < n; i++) {
+        shadowpath(path, i + 1);
+        if (!(fps[i] = fopen(path, "r+")))
+            die("%s: missing, run --shard init/%u first\n", path, shards);
+        readbmpheader(&header, fps[i]);
+        offsets[i]       = header.bmpheader.offset;
+        shadownumbers[i] = header.bmpheader.unused2;
+        if (shadownumbers[i] != i + 1 || xfilesize(fileno(fps[i])) < offsets[i] + 8 * (off_t) blocks)
+            die("%s: not made by --shard init for this secret\n", path);
+    }
+}
+
+/* --shard init/m: picks the covers as -d would and copies them to the
+ * outputs, with their key and shadow number set, for the shards to hide their
+ * blocks in. Markers left by an earlier run are removed */
+void
+shardinit(const char *dir, const char *imgpath, uint16_t k, uint16_t n, uint16_t seed) {
+    char path[PATH_MAX];
+    Bitmap header;
+    FILE *fp = xfopen(imgpath, "r");
+
+    readbmpheader(&header, fp);
+    readdibheader(&header, fp);
+    xfclose(fp);
+
+    char **filepaths = getbmpfilenames(dir, k, n, sharedpixels(header.dibheader.width, header.dibheader.height));
+    for (size_t i = 0; i < n; i++) {
+        FILE *cover = xfopen(filepaths[i], "r");
+        readbmpheader(&header, cover);
+        readdibheader(&header, cover);
+        xfread(header.palette, PALETTE_SIZE, 1, cover);
+        header.bmpheader.unused1 = seed;
+        header.bmpheader.unused2 = i + 1;
+        setshadowcrc(&header, 0, 0); /* until shardcheck() */
+
+        shadowpath(path, i + 1);
+        FILE *output = createoutputstream(path);
+        writebmpheader(&header, output);
+        writedibheader(&header, output);
+        xfwrite(header.palette, PALETTE_SIZE, 1, output);
+        xfflush(output);
+        xcopyrange(fileno(cover), fileno(output), header.bmpheader.offset, header.bmpheader.offset, bmpimagesize(&header));
+        commitoutput(fileno(output), path);
+        xfclose(output);
+        xfclose(cover);
+        free(filepaths[i]);
+    }
+    free(filepaths);
+    syncoutputs();
+
+    for (uint32_t i = 1; i <= shards; i++) {
+        shardmarker(path, i);
+        unlink(path);
+    }
+}
+
+/* --shard i/m: shares blocks of the i-th of m contiguous ranges, reading only
+ * their slice of the secret, and hides them in the outputs in place. Ranges
+ * are written by different processes, maybe on different hosts sharing the
+ * file system, to disjoint bytes of the outputs */
+void
+shardwork(const char *imgpath, uint16_t k, uint16_t n) {
+    Bitmap header;
+    FILE *fp = xfopen(imgpath, "r");
+
+    readbmpheader(&header, fp);
+    readdibheader(&header, fp);
+
+    uint32_t blocks = shadowsize(sharedpixels(header.dibheader.width, header.dibheader.height), k);
+    uint32_t first, last;
+    FILE **fps = xmalloc(sizeof(*fps) * n);
+    uint32_t *offsets       = xmalloc(sizeof(*offsets) * n);
+    uint16_t *shadownumbers = xmalloc(sizeof(*shadownumbers) * n);
+    uint8_t *data   = xmalloc((size_t) REGION_CHUNK_BLOCKS * k);
+    uint8_t *shares = xmalloc((size_t) n * REGION_CHUNK_BLOCKS);
+    char path[PATH_MAX];
+
+    shardrange(blocks, shard, &first, &last);
+    openshardoutputs(n, blocks, fps, offsets, shadownumbers);
+    for (uint32_t b = first; b < last; b += REGION_CHUNK_BLOCKS) {
+        uint32_t count = MIN(REGION_CHUNK_BLOCKS, last - b);
+        readsecretslice(fileno(fp), &header, b * k, count * k, data);
+        for (size_t j = 0; j < count; j++)
+            for (size_t i = 0; i < n; i++)
+                shares[i * REGION_CHUNK_BLOCKS + j] = generatepixel(&data[j * k], k-1, shadownumbers[i]);
+        for (size_t i = 0; i < n; i++)
+            embedrange(fileno(fps[i]), fileno(fps[i]), offsets[i], offsets[i], &shares[i * REGION_CHUNK_BLOCKS], b, count);
+    }
+    for (size_t i = 0; i < n; i++) {
+        /* written in place; only the data is synced */
+        shadowpath(path, i + 1);
+        if (durability != DURABLE_NONE && fdatasync(fileno(fps[i])))
+            die("fdatasync: couldn't sync %s\n", path);
+        xfclose(fps[i]);
+    }
+
+    shardmarker(path, shard);
+    FILE *marker = createoutputstream(path);
+    fprintf(marker, "%d %d %u %u\n", k, n, first, last);
+    xfflush(marker);
+    commitoutput(fileno(marker), path);
+    xfclose(marker);
+    syncoutputs();
+
+    xfclose(fp);
+    free(shares);
+    free(data);
+    free(shadownumbers);
+    free(offsets);
+    free(fps);
+}
+
+/* --shard check/m: once every shard left its marker, and they cover all the
+ * blocks, the outputs get the CRC-32C of their shadows and the markers are
+ * removed. Otherwise the missing shards are reported */
+void
+shardcheck(const char *imgpath, uint16_t k, uint16_t n) {
+    Bitmap header;
+    FILE *fp = xfopen(imgpath, "r");
+    char path[PATH_MAX], line[128], expected[128];
+    uint32_t missing = 0;
+
+    readbmpheader(&header, fp);
+    readdibheader(&header, fp);
+    xfclose(fp);
+
+    uint32_t blocks = shadowsize(sharedpixels(header.dibheader.width, header.dibheader.height), k);
+    for (uint32_t i = 1; i <= shards; i++) {
+        uint32_t first, last;
+        shardrange(blocks, i, &first, &last);
+        xsnprintf(expected, sizeof(expected), "%d %d %u %u\n", k, n, first, last);
+        shardmarker(path, i);
+        FILE *marker = fopen(path, "r");
+        if (!marker || !fgets(line, sizeof(line), marker) || strcmp(line, expected)) {
+            fprintf(stderr, "shard %u/%u (blocks %u to %u) isn't done\n", i, shards, first, last);
+            missing++;
+        }
+        if (marker)
+            xfclose(marker);
+    }
+    if (missing)
+        die("%u of %u shards missing\n", missing, shards);
+
+    FILE **fps = xmalloc(sizeof(*fps) * n);
+    uint32_t *offsets       = xmalloc(sizeof(*offsets) * n);
+    uint16_t *shadownumbers = xmalloc(sizeof(*shadownumbers) * n);
+    uint32_t *crcs          = xmalloc(sizeof(*crcs) * n);
+    uint8_t *shares         = xmalloc((size_t) n * REGION_CHUNK_BLOCKS);
+
+    openshardoutputs(n, blocks, fps, offsets, shadownumbers);
+    for (size_t i = 0; i < n; i++)
+        crcs[i] = 0;
+    for (uint32_t first = 0; first < blocks; first += REGION_CHUNK_BLOCKS) {
+        uint32_t count = MIN(REGION_CHUNK_BLOCKS, blocks - first);
+        readshares(fps, offsets, n, first, count, shares);
+        for (size_t i = 0; i < n; i++)
+            crcs[i] = crc32c(crcs[i], &shares[i * count], count);
+    }
+    for (size_t i = 0; i < n; i++) {
+        writeshadowcrc(fileno(fps[i]), crcs[i], blocks);
+        shadowpath(path, i + 1);
+        if (durability != DURABLE_NONE && fdatasync(fileno(fps[i])))
+            die("fdatasync: couldn't sync %s\n", path);
+        xfclose(fps[i]);
+    }
+    for (uint32_t i = 1; i <= shards; i++) {
+        shardmarker(path, i);
+        unlink(path);
+    }
+
+    free(shares);
+    free(crcs);
+    free(shadownumbers);
+    free(offsets);
+    free(fps);
+}
+
+/* Turns k shadows of a (k, n) distribution into the shadows of a new
+ * (newk, newn) distribution of the same secret, hidden in covers from coverdir,
+ * without ever writing the secret. The secret is processed RESHARE_CHUNK bytes
+ * at a time, reading and writing only the matching slices of the covers */
+void
+reshareimage(const char *dir, const char *coverdir, uint32_t width, int32_t height, uint16_t k, uint16_t newk, uint16_t newn) {
+    uint32_t secretsize = sharedpixels(width, height);
+    uint32_t oldblocks  = ALIGN_UP(secretsize, k) / k;
+    uint32_t newblocks  = ALIGN_UP(secretsize, newk) / newk;
+    uint32_t lcm        = k / gcd(k, newk) * newk;
+    uint32_t chunk      = lcm * (RESHARE_CHUNK / lcm + 1);
+    char **filepaths    = getshadowfilenames(dir, k, sharedpixels(width, height));
+    char **coverpaths   = getbmpfilenames(coverdir, newk, newn, secretsize);
+    FILE **fps          = xmalloc(sizeof(*fps) * k);
+    FILE **covers       = xmalloc(sizeof(*covers) * newn);
+    FILE **outputs      = xmalloc(sizeof(*outputs) * newn);
+    uint32_t *offsets       = xmalloc(sizeof(*offsets) * k);
+    uint32_t *coveroffsets  = xmalloc(sizeof(*coveroffsets) * newn);
+    uint32_t *coversizes    = xmalloc(sizeof(*coversizes) * newn);
+    uint16_t *shadownumbers = xmalloc(sizeof(*shadownumbers) * k);
+    uint16_t *newnumbers    = xmalloc(sizeof(*newnumbers) * newn);
+    uint32_t *crcs          = xmalloc(sizeof(*crcs) * newn);
+    uint8_t *shares    = xmalloc(chunk);
+    uint8_t *newshares = xmalloc((size_t) newn * (chunk / newk));
+    uint8_t *secret    = xmalloc(chunk);
+    uint8_t *values    = xmalloc(k);
+    int **inv          = newmatrix(k, k);
+    int **transform    = newmatrix(newn, k);
+    char shadowfilename[PATH_MAX];
+    Bitmap header;
+
+    uint16_t seed = openshadowfiles(filepaths, k, fps, offsets, shadownumbers);
+    interpolationmatrix(shadownumbers, k, inv);
+    for (size_t i = 0; i < newn; i++) {
+        newnumbers[i] = i+1;
+        crcs[i]       = 0;
+    }
+    /* with the same k, reveal and share again compose into one linear map */
+    if (k == newk)
+        evaluationmatrix(inv, k, newnumbers, newn, transform);
+
+    for (size_t i = 0; i < newn; i++) {
+        covers[i] = xfopen(coverpaths[i], "r");
+        readbmpheader(&header, covers[i]);
+        readdibheader(&header, covers[i]);
+        xfread(header.palette, sizeof(header.palette), 1, covers[i]);
+        coveroffsets[i] = header.bmpheader.offset;
+        coversizes[i]   = bmpimagesize(&header);
+
+        /* the pixels go right after the palette, whatever the cover's offset */
+        header.bmpheader.offset  = PIXEL_ARRAY_OFFSET;
+        header.bmpheader.size    = PIXEL_ARRAY_OFFSET + coversizes[i];
+        header.bmpheader.unused1 = seed;
+        header.bmpheader.unused2 = newnumbers[i];
+        shadowpath(shadowfilename, newnumbers[i]);
+        outputs[i] = createoutputstream(shadowfilename);
+        writebmpheader(&header, outputs[i]);
+        writedibheader(&header, outputs[i]);
+        xfwrite(header.palette, PALETTE_SIZE, 1, outputs[i]);
+        if (fflush(outputs[i]))
+            die("fflush: error\n");
+    }
+
+    for (uint32_t start = 0; start < secretsize; start += chunk) {
+        uint32_t first    = start / k;
+        uint32_t blocks   = MIN(chunk / k, oldblocks - first);
+        uint32_t newfirst = start / newk;
+        uint32_t nblocks  = MIN(chunk / newk, newblocks - newfirst);
+
+        readshares(fps, offsets, k, first, blocks, shares);
+        for (size_t b = 0; b < blocks; b++) {
+            for (size_t j = 0; j < k; j++)
+                values[j] = shares[j * blocks + b];
+            if (k == newk) {
+                for (size_t i = 0; i < newn; i++) {
+                    uint32_t sum = 0;
+                    for (size_t c = 0; c < k; c++)
+                        sum += (uint32_t) transform[i][c] * values[c];
+                    newshares[i * nblocks + b] = sum % PRIME;
+                }
+            } else {
+                revealblock(inv, values, k, &secret[b * k]);
+            }
+        }
+        if (k != newk) {
+            uint32_t valid = MIN(blocks * k, secretsize - start);
+            memset(&secret[valid], 0, chunk - valid);
+            for (size_t b = 0; b < nblocks; b++)
+                for (size_t i = 0; i < newn; i++)
+                    newshares[i * nblocks + b] = generatepixel(&secret[b * newk], newk-1, newnumbers[i]);
+        }
+
+        for (size_t i = 0; i < newn; i++) {
+            embedrange(fileno(covers[i]), fileno(outputs[i]), coveroffsets[i], PIXEL_ARRAY_OFFSET,
+                    &newshares[i * nblocks], newfirst, nblocks);
+            crcs[i] = crc32c(crcs[i], &newshares[i * nblocks], nblocks);
+        }
+    }
+
+    for (size_t i = 0; i < newn; i++) {
+        uint32_t hidden = 8 * newblocks;
+        xcopyrange(fileno(covers[i]), fileno(outputs[i]), coveroffsets[i] + hidden,
+                PIXEL_ARRAY_OFFSET + hidden, coversizes[i] - hidden);
+        writeshadowcrc(fileno(outputs[i]), crcs[i], newblocks);
+        shadowpath(shadowfilename, newnumbers[i]);
+        commitoutput(fileno(outputs[i]), shadowfilename);
+        xfclose(outputs[i]);
+        xfclose(covers[i]);
+        free(coverpaths[i]);
+    }
+    syncoutputs();
+    for (size_t j = 0; j < k; j++) {
+        xfclose(fps[j]);
+        free(filepaths[j]);
+    }
+
+    freematrix(transform, newn);
+    freematrix(inv, k);
+    free(values);
+    free(secret);
+    free(newshares);
+    free(shares);
+    free(crcs);
+    free(newnumbers);
+    free(shadownumbers);
+    free(coversizes);
+    free(coveroffsets);
+    free(offsets);
+    free(outputs);
+    free(covers);
+    free(fps);
+    free(coverpaths);
+    free(filepaths);
+}
+
+/* Recovers the image from m > k shadows, correcting wrong ones, and reports
+ * which shadows were faulty. Those failing their checksum are skipped, so up
+ * to (m-k-f)/2 wrong shadows are corrected when f of them fail it */
+void
+recovercorrecting(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k, uint16_t m) {
+    Bitmap **shadows = xmalloc(sizeof(*shadows) * m);
+    uint32_t *faults = xmalloc(sizeof(*faults) * m);
+
+    char **filepaths = getwarmfilenames(dir, k, m, isvalidshadow, sharedpixels(width, height));
+    uint16_t loaded = 0;
+    /* shadows failing their checksum are known erasures: they are left out
+     * rather than using up the correction capacity of the others */
+    for (size_t i = 0; i < m; i++) {
+        Bitmap *shadow = loadshadow(filepaths[i], width, height, k);
+        if (!shadow) {
+            free(filepaths[i]);
+            continue;
+        }
+        filepaths[loaded] = filepaths[i];
+        shadows[loaded++] = shadow;
+    }
+    if (loaded < k)
+        die("not enough valid shadows for a (%d,%d) threshold scheme in dir %s\n", k, k, dir);
+
+    Bitmap *bmp = revealcorrecting(shadows, loaded, width, height, k, faults);
+    bmptofile(bmp, filename);
+    freebitmap(bmp);
+
+    for (size_t i = 0; i < loaded; i++) {
+        if (faults[i])
+            fprintf(stderr, "%s: shadow %d wrong in %u of %u sections\n", filepaths[i],
+                    shadows[i]->bmpheader.unused2, faults[i], shadows[i]->dibheader.pixelarraysize);
+        free(filepaths[i]);
+        freebitmap(shadows[i]);
+    }
+    free(filepaths);
+    free(faults);
+    free(shadows);
+}
+
+/* the padding of the rows isn't shared, so it's left alone */
+void
+truncategrayscale(Bitmap *bp) {
+    uint32_t width  = bp->dibheader.width;
+    uint32_t stride = calculatepixelarraysize(width, 1);
+    uint32_t rows   = abs(bp->dibheader.height);
+
+    for (uint32_t r = 0; r < rows; r++) {
+        uint8_t *row = &bp->imgpixels[r * stride];
+        for (uint32_t x = 0; x < width; x++)
+            if (row[x] > 250)
+                row[x] = 250;
+    }
+}
+
+void
+permutepixels(Bitmap *bp, uint16_t seed) {
+    uint32_t imgsize = bmpimagesize(bp);
+    uint8_t *p  = bp->imgpixels;
+
+    srand(seed);
+    for (uint32_t i = imgsize - 1; i > 1; i--) {
+        long j = randint(i);
+        swap(&p[j], &p[i]);
+    }
 }
 
 void
@@ -705,29 +4300,49 @@ unpermutepixels(Bitmap *bp, uint16_t seed) {
  * section polynomial and generate a pixel for a shadow image */
 uint8_t
 generatepixel(const uint8_t *coeff, uint16_t degree, uint16_t value) {
-    intmax_t ret = 0;
+    uint32_t ret = 0;
 
-    for (size_t i = 0; i <= degree; i++)
-        ret += coeff[i] * pow(value, i);
+    value %= PRIME;
+    for (int i = degree; i >= 0; i--) /* Horner's rule */
+        ret = (ret * value + coeff[i]) % PRIME;
 
-    return ret % PRIME;
+    return ret;
 }
 
 int
 main(int argc, char *argv[argc + 1]) {
     bool dflag      = 0;
     bool rflag      = 0;
+    bool eflag      = 0;
+    bool reshareflag = 0;
+    bool framedelta = 0;
     bool kflag      = 0;
     bool wflag      = 0;
     bool hflag      = 0;
     bool nflag      = 0;
     bool secretflag = 0;
+    bool regionflag = 0;
+    uint16_t m      = 0;
+    uint16_t hedge  = 0;
+    uint16_t newshadownumber = 0;
+    uint16_t newk   = 0;
     uint16_t seed   = DEFAULT_SEED;
     uint16_t k      = 0;
     uint16_t n      = 0;
     uint32_t width  = 0;
     int32_t height  = 0;
+    uint16_t level   = PROGRESSIVE_LEVELS - 1;
+    uint32_t rowfrom = 0, rowto = 0;
+    uint32_t colfrom = 0, colto = 0;
     char *filename  = 0;
+    char **secrets  = NULL;
+    size_t secretcount = 0;
+    bool planflag   = 0;
+    char *cachespec = 0;
+    char *coverpath = 0;
+    char *coverdir  = 0;
+    char *oldpath   = 0;
+    char *videopath = 0;
     char *dir       = "./";
     char *endptr;
 
@@ -738,10 +4353,62 @@ main(int argc, char *argv[argc + 1]) {
             dflag = 1;
         } else if (strcmp(argv[i], "-r") == 0) {
             rflag = 1;
+        } else if (strcmp(argv[i], "-e") == 0) {
+            eflag = 1;
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (0 < l && l < PRIME)
+                    newshadownumber = l;
+                else
+                    die("shadow number must be 1 <= number < %d; was %ld\n", PRIME, l);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--reshare") == 0) {
+            reshareflag = 1;
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (2 <= l && l <= UINT16_MAX)
+                    newk = l;
+                else
+                    die("new k must be 2 <= k <= %d; was %ld\n", UINT16_MAX, l);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--delta") == 0) {
+            if (i + 1 < argc) {
+                oldpath = argv[++i];
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--video") == 0) {
+            if (i + 1 < argc) {
+                videopath = argv[++i];
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--frame-delta") == 0) {
+            framedelta = 1;
+        } else if (strcmp(argv[i], "--timing") == 0) {
+            timing = 1;
+        } else if (strcmp(argv[i], "--covers") == 0) {
+            if (i + 1 < argc) {
+                coverdir = argv[++i];
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--cover") == 0) {
+            if (i + 1 < argc) {
+                coverpath = argv[++i];
+            } else {
+                usage();
+            }
         } else if (strcmp(argv[i], "--secret") == 0) {
             secretflag = 1;
             if (i + 1 < argc) {
                 filename = argv[++i];
+                secrets  = xrealloc(secrets, sizeof(*secrets) * (secretcount + 1));
+                secrets[secretcount++] = filename;
             } else {
                 usage();
             }
@@ -799,6 +4466,131 @@ main(int argc, char *argv[argc + 1]) {
             } else {
                 usage();
             }
+        } else if (strcmp(argv[i], "--out-dir") == 0) {
+            if (i + 1 < argc) {
+                outdir = argv[++i];
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--name") == 0) {
+            if (i + 1 < argc) {
+                parsename(argv[++i]);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--io") == 0) {
+            if (i + 1 < argc) {
+                iomode = parseio(argv[++i]);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--journal") == 0) {
+            if (i + 1 < argc) {
+                journalpath = argv[++i];
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--cover-cache") == 0) {
+            if (i + 1 < argc) {
+                cachespec = argv[++i];
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--shard") == 0) {
+            if (i + 1 < argc) {
+                parseshard(argv[++i]);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--plan") == 0) {
+            planflag = 1;
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            if (i + 1 < argc) {
+                verifypercent = parseverify(argv[++i]);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--sink") == 0) {
+            if (i + 1 < argc) {
+                parsesink(argv[++i]);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--durability") == 0) {
+            if (i + 1 < argc) {
+                durability = parsedurability(argv[++i]);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 < argc) {
+                jobs = xstrtol(argv[++i], &endptr, 10);
+                if (jobs < 1 || jobs > UINT16_MAX)
+                    die("jobs must be 1 <= jobs <= %d; was %ld\n", UINT16_MAX, jobs);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--raw") == 0) {
+            raw = 1;
+        } else if (strcmp(argv[i], "--archive") == 0) {
+            if (i + 1 < argc) {
+                archivepath = argv[++i];
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--shadows") == 0) {
+            if (i + 1 < argc) {
+                parsesubset(argv[++i]);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--hedge") == 0) {
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (0 < l && l <= UINT16_MAX)
+                    hedge = l;
+                else
+                    die("m must be k <= m <= %d; was %ld\n", UINT16_MAX, l);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--correct") == 0) {
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (0 < l && l <= UINT16_MAX)
+                    m = l;
+                else
+                    die("m must be k < m <= %d; was %ld\n", UINT16_MAX, l);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--progressive") == 0) {
+            progressive = 1;
+        } else if (strcmp(argv[i], "--preview") == 0) {
+            progressive = 1;
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (0 <= l && l < PROGRESSIVE_LEVELS)
+                    level = l;
+                else
+                    die("preview level must be 0 <= level < %d; was %ld\n", PROGRESSIVE_LEVELS, l);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--rows") == 0) {
+            regionflag = 1;
+            if (i + 1 < argc) {
+                parserange(argv[++i], &rowfrom, &rowto);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--cols") == 0) {
+            regionflag = 1;
+            if (i + 1 < argc) {
+                parserange(argv[++i], &colfrom, &colto);
+            } else {
+                usage();
+            }
         } else if (strcmp(argv[i], "--dir") == 0) {
             if (i + 1 < argc) {
                 dir = argv[++i];
@@ -810,21 +4602,105 @@ main(int argc, char *argv[argc + 1]) {
         }
     }
 
-    if (!(dflag || rflag) || !secretflag || !kflag)
+    if (!(dflag || rflag || eflag || reshareflag) || !(secretflag || eflag || reshareflag || videopath) || !kflag)
         usage();
-    if ((rflag && !(wflag && hflag)) || !width || !height)
+    if (videopath || planflag) { /* frame geometry comes from the stream, or isn't needed */
+        width  = wflag ? width : 1;
+        height = hflag ? height : 1;
+    }
+    if (eflag && !coverpath)
+        die("specify the cover to hide the new shadow in with --cover\n");
+    if (reshareflag && !coverdir)
+        die("specify the directory with the new covers with --covers\n");
+    if (((rflag || eflag || reshareflag) && !(wflag && hflag)) || !width || !height)
         die("specify a positive width and height with -w -h for the revealed image\n");
 
-    if (!nflag)
-        n = countfiles(dir);
+    if (!nflag) /* when recovering from an archive the directory isn't used */
+        n = rflag && archivepath ? k : countfiles(reshareflag ? coverdir : dir);
 
-    if (k > n || k < 2 || n < 2)
+    if ((reshareflag ? newk : k) > n || k < 2 || n < 2)
         die("k and n must be: 2 <= k <= n\n");
-    if (dflag && rflag)
-        die("can't use -d and -r flags simultaneously\n");
+    if (dflag + rflag + eflag + reshareflag > 1)
+        die("can't use -d, -r, -e and --reshare flags simultaneously\n");
+    if (videopath && (!dflag || secretflag || raw || progressive || oldpath))
+        die("--video replaces --secret with -d, and only works with BMPs or --archive\n");
+    if (secretcount > 1 && !planflag)
+        die("only --plan takes more than one --secret\n");
+    if (planflag && (!dflag || videopath || oldpath))
+        die("--plan only works with -d, without --video or --delta\n");
+    if (cachespec && (!(dflag || eflag) || iomode == IO_MMAP || shards || planflag))
+        die("--cover-cache only works with -d or -e, without --io mmap, --shard or --plan\n");
+    if (cachespec)
+        opencovercache(cachespec);
+    if (shards && (!dflag || videopath || oldpath || planflag || raw || archivepath
+                || progressive || sinkcount || journalpath || verifypercent))
+        die("--shard only works with -d and BMP shadows, without --video, --delta, --plan, "
+                "--progressive, --sink, --journal or --verify\n");
+    if (journalpath && (!dflag || planflag || oldpath || raw || archivepath))
+        die("--journal only works with -d and BMP shadows, without --delta or --plan\n");
+    if (verifypercent && (!dflag || videopath || oldpath || progressive))
+        die("--verify only works with -d, without --video, --delta or --progressive\n");
+    if (sinkcount && (!dflag || videopath || oldpath || archivepath))
+        die("--sink only works with -d and BMP shadows\n");
+    for (size_t i = 0; i < sinkcount; i++)
+        if (sinks[i].shadownumber > n)
+            die("--sink for shadow %d, but there are only %d\n", sinks[i].shadownumber, n);
+    if (sinkcount) /* a reader going away must fail the write, not kill us */
+        signal(SIGPIPE, SIG_IGN);
+    if (framedelta && !videopath)
+        die("--frame-delta needs --video\n");
+    if (oldpath && (!dflag || raw || archivepath || progressive))
+        die("--delta needs -d and BMP shadows\n");
+    if (reshareflag && (raw || archivepath || regionflag || progressive || m))
+        die("--reshare only works with BMP shadows\n");
+    if (reshareflag && issamedir(dir, outdir))
+        die("--reshare writes shadow files to --out-dir, so the old shadows must "
+                "be elsewhere\n");
+    if (eflag && (archivepath || regionflag || progressive || m))
+        die("-e only works with BMP or raw shadows\n");
+    if (hedge && (!rflag || hedge < k || m || raw || archivepath || regionflag || progressive))
+        die("--hedge m needs -r, k <= m, and BMP shadows\n");
+    if (m && (!rflag || m <= k || raw || archivepath || regionflag || progressive))
+        die("--correct m needs -r, k < m, and BMP shadows\n");
+    if (progressive && (raw || archivepath || regionflag))
+        die("--progressive can't be combined with --raw, --archive, --rows or --cols\n");
+    if (regionflag) {
+        if (!rflag || raw || archivepath)
+            die("--rows and --cols can only be used to recover from BMPs\n");
+        if (!rowto)
+            rowto = abs(height);
+        if (!colto)
+            colto = width;
+        if (rowto > abs(height) || colto > width)
+            die("region must lie within the %ux%d image\n", width, abs(height));
+    }
 
-    if (dflag)
+    if (planflag)
+        planbatch(dir, secrets, secretcount, k, n);
+    else if (dflag && shards && shard == SHARD_INIT)
+        shardinit(dir, filename, k, n, seed);
+    else if (dflag && shards && shard == SHARD_CHECK)
+        shardcheck(filename, k, n);
+    else if (dflag && shards)
+        shardwork(filename, k, n);
+    else if (dflag && videopath)
+        distributevideo(dir, videopath, k, n, seed, framedelta);
+    else if (dflag && oldpath)
+        deltaimage(dir, filename, oldpath, k, n);
+    else if (dflag)
         distributeimage(dir, filename, k, n, seed);
+    else if (eflag)
+        extendimage(dir, coverpath, width, height, k, newshadownumber);
+    else if (reshareflag)
+        reshareimage(dir, coverdir, width, height, k, newk, n);
+    else if (rflag && hedge)
+        recoverhedged(dir, filename, width, height, k, hedge);
+    else if (rflag && m)
+        recovercorrecting(dir, filename, width, height, k, m);
+    else if (rflag && progressive)
+        recoverpreview(dir, filename, width, height, k, level);
+    else if (rflag && regionflag)
+        recoverregion(dir, filename, width, height, k, rowfrom, rowto, colfrom, colto);
     else if (rflag)
         recoverimage(dir, filename, width, height, k);
 
@@ -1,11 +1,20 @@
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "util.h"
 
@@ -35,6 +44,12 @@ xfclose(FILE *fp) {
         die("fclose: error\n");
 }
 
+void
+xfflush(FILE *fp) {
+    if (fflush(fp) == EOF)
+        die("fflush: error\n");
+}
+
 void
 xfread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
     if (fread(ptr, size, nmemb, stream) < 1)
@@ -81,6 +96,251 @@ xmalloc(size_t size) {
     return p;
 }
 
+void *
+xrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+
+    if (!p)
+        die("xrealloc: couldn't allocate %zu bytes\n", size);
+
+    return p;
+}
+
+char *
+xstrdup(const char *s) {
+    char *p = xmalloc(strlen(s) + 1);
+
+    return strcpy(p, s);
+}
+
+/* size must be a multiple of alignment */
+void *
+xalignedalloc(size_t alignment, size_t size) {
+    void *p = aligned_alloc(alignment, size);
+
+    if (!p)
+        die("xalignedalloc: couldn't allocate %zu bytes\n", size);
+
+    return p;
+}
+
+int
+xopen(const char *pathname, int flags) {
+    int fd = open(pathname, flags, 0644);
+
+    if (fd < 0)
+        die("open: couldn't open %s\n", pathname);
+
+    return fd;
+}
+
+void
+xclose(int fd) {
+    if (close(fd))
+        die("close: error\n");
+}
+
+/* reads exactly count bytes, retrying on short reads */
+void
+xpread(int fd, void *buf, size_t count, off_t offset) {
+    uint8_t *p = buf;
+
+    while (count) {
+        ssize_t r = pread(fd, p, count, offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            die("pread: error or unexpected end of file\n");
+        p      += r;
+        count  -= r;
+        offset += r;
+    }
+}
+
+/* writes exactly count bytes, retrying on short writes */
+void
+xpwrite(int fd, const void *buf, size_t count, off_t offset) {
+    const uint8_t *p = buf;
+
+    while (count) {
+        ssize_t w = pwrite(fd, p, count, offset);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            die("pwrite: error\n");
+        p      += w;
+        count  -= w;
+        offset += w;
+    }
+}
+
+/* writes exactly count bytes at the current position of fd */
+void
+xwrite(int fd, const void *buf, size_t count) {
+    const uint8_t *p = buf;
+
+    while (count) {
+        ssize_t w = write(fd, p, count);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            die("write: error\n");
+        p     += w;
+        count -= w;
+    }
+}
+
+/* writes count bytes to fd, mapping the pages into it with vmsplice when fd is
+ * a pipe. The pipe keeps referencing the pages, so buf must not be modified
+ * after this returns */
+void
+xwritepipe(int fd, const void *buf, size_t count) {
+    struct stat st;
+    const uint8_t *p = buf;
+
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        while (count) {
+            struct iovec iov = { .iov_base = (void *) p, .iov_len = count };
+            ssize_t w = vmsplice(fd, &iov, 1, 0);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                break; /* not supported, fall back to write */
+            p     += w;
+            count -= w;
+        }
+    }
+    xwrite(fd, p, count);
+}
+
+/* copies length bytes at inoffset of infd to outoffset of outfd */
+void
+xcopyrange(int infd, int outfd, off_t inoffset, off_t outoffset, size_t length) {
+    uint8_t buf[1 << 16];
+
+    while (length) {
+        size_t count = length < sizeof(buf) ? length : sizeof(buf);
+        xpread(infd, buf, count, inoffset);
+        xpwrite(outfd, buf, count, outoffset);
+        inoffset  += count;
+        outoffset += count;
+        length    -= count;
+    }
+}
+
+off_t
+xfilesize(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st))
+        die("fstat: error\n");
+
+    return st.st_size;
+}
+
+void *
+xmmap(size_t length, int prot, int flags, int fd, off_t offset) {
+    void *p = mmap(NULL, length, prot, flags, fd, offset);
+
+    if (p == MAP_FAILED)
+        die("mmap: couldn't map %zu bytes\n", length);
+
+    return p;
+}
+
+void
+xmunmap(void *addr, size_t length) {
+    if (munmap(addr, length))
+        die("munmap: error\n");
+}
+
+void
+xpthread_create(pthread_t *thread, void *(*routine)(void *), void *arg) {
+    if (pthread_create(thread, NULL, routine, arg))
+        die("pthread_create: error\n");
+}
+
+void
+xpthread_join(pthread_t thread) {
+    if (pthread_join(thread, NULL))
+        die("pthread_join: error\n");
+}
+
+void
+queueinit(Queue *q, size_t capacity) {
+    q->items    = xmalloc(sizeof(*q->items) * capacity);
+    q->capacity = capacity;
+    q->head     = 0;
+    q->count    = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notempty, NULL);
+    pthread_cond_init(&q->notfull, NULL);
+}
+
+void
+queuefree(Queue *q) {
+    pthread_cond_destroy(&q->notfull);
+    pthread_cond_destroy(&q->notempty);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+}
+
+/* blocks while the queue is full */
+void
+queuepush(Queue *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+        pthread_cond_wait(&q->notfull, &q->lock);
+    q->items[(q->head + q->count++) % q->capacity] = item;
+    pthread_cond_signal(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* blocks while the queue is empty */
+void *
+queuepop(Queue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0)
+        pthread_cond_wait(&q->notempty, &q->lock);
+    void *item = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->notfull);
+    pthread_mutex_unlock(&q->lock);
+
+    return item;
+}
+
+/* fraction of the first length bytes of fd that are in the page cache */
+double
+residentfraction(int fd, size_t length) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t pages    = (length + pagesize - 1) / pagesize;
+
+    if (!pages)
+        return 1;
+    void *p = xmmap(length, PROT_READ, MAP_SHARED, fd, 0);
+    unsigned char *vec = xmalloc(pages);
+    size_t resident = 0;
+    if (mincore(p, length, vec) == 0)
+        for (size_t i = 0; i < pages; i++)
+            resident += vec[i] & 1;
+    free(vec);
+    xmunmap(p, length);
+
+    return (double) resident / pages;
+}
+
+/* seconds from an arbitrary starting point, for measuring intervals */
+double
+monotime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 size_t
 xsnprintf(char *str, size_t size, const char *fmt, ...) {
     va_list ap;
@@ -115,6 +375,17 @@ mod(int a, int b) {
     return m < 0 ? m + b : m;
 }
 
+int
+gcd(int a, int b) {
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
 inline void
 uint16swap(uint16_t *x) {
     *x = *x >> 8 | *x << 8;
@@ -128,6 +399,16 @@ uint32swap(uint32_t *x) {
        | ((*x & 0xFF000000UL) >> 24);
 }
 
+inline void
+uint64swap(uint64_t *x) {
+    uint32_t lo = *x & 0xFFFFFFFFUL;
+    uint32_t hi = *x >> 32;
+
+    uint32swap(&lo);
+    uint32swap(&hi);
+    *x = (uint64_t) lo << 32 | hi;
+}
+
 inline void
 int32swap(int32_t *x) {
     *x = ((*x << 8) & 0xFF00FF00)
@@ -154,3 +435,91 @@ xstrtol(const char *nptr, char **end, int base){
 
     return sl;
 }
+
+/* CRC-32C (Castagnoli), reflected polynomial 0x82F63B78 */
+static const uint32_t crc32ctable[256] = {
+    0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4, 0xC79A971F, 0x35F1141C,
+    0x26A1E7E8, 0xD4CA64EB, 0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B,
+    0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24, 0x105EC76F, 0xE235446C,
+    0xF165B798, 0x030E349B, 0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+    0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54, 0x5D1D08BF, 0xAF768BBC,
+    0xBC267848, 0x4E4DFB4B, 0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A,
+    0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35, 0xAA64D611, 0x580F5512,
+    0x4B5FA6E6, 0xB93425E5, 0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+    0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45, 0xF779DEAE, 0x05125DAD,
+    0x1642AE59, 0xE4292D5A, 0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A,
+    0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595, 0x417B1DBC, 0xB3109EBF,
+    0xA0406D4B, 0x522BEE48, 0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+    0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687, 0x0C38D26C, 0xFE53516F,
+    0xED03A29B, 0x1F682198, 0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927,
+    0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38, 0xDBFC821C, 0x2997011F,
+    0x3AC7F2EB, 0xC8AC71E8, 0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+    0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096, 0xA65C047D, 0x5437877E,
+    0x4767748A, 0xB50CF789, 0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859,
+    0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46, 0x7198540D, 0x83F3D70E,
+    0x90A324FA, 0x62C8A7F9, 0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+    0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36, 0x3CDB9BDD, 0xCEB018DE,
+    0xDDE0EB2A, 0x2F8B6829, 0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C,
+    0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93, 0x082F63B7, 0xFA44E0B4,
+    0xE9141340, 0x1B7F9043, 0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+    0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3, 0x55326B08, 0xA759E80B,
+    0xB4091BFF, 0x466298FC, 0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C,
+    0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033, 0xA24BB5A6, 0x502036A5,
+    0x4370C551, 0xB11B4652, 0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+    0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D, 0xEF087A76, 0x1D63F975,
+    0x0E330A81, 0xFC588982, 0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D,
+    0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622, 0x38CC2A06, 0xCAA7A905,
+    0xD9F75AF1, 0x2B9CD9F2, 0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+    0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530, 0x0417B1DB, 0xF67C32D8,
+    0xE52CC12C, 0x1747422F, 0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF,
+    0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0, 0xD3D3E1AB, 0x21B862A8,
+    0x32E8915C, 0xC083125F, 0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+    0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90, 0x9E902E7B, 0x6CFBAD78,
+    0x7FAB5E8C, 0x8DC0DD8F, 0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE,
+    0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1, 0x69E9F0D5, 0x9B8273D6,
+    0x88D28022, 0x7AB90321, 0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+    0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81, 0x34F4F86A, 0xC69F7B69,
+    0xD5CF889D, 0x27A40B9E, 0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E,
+    0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351
+};
+
+static uint32_t
+crc32ctablebased(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len--)
+        crc = crc32ctable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+/* the SSE4.2 crc32 instruction computes CRC-32C, 8 bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32csse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t crc64 = crc;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word)); /* unaligned, and x86 is little-endian */
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+#endif
+
+/* Pass 0 as the initial crc, or a previous return value to continue a running
+ * checksum. Uses the SSE4.2 instruction where the CPU has it */
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2"))
+        return ~crc32csse42(~crc, buf, len);
+#endif
+    return ~crc32ctablebased(~crc, buf, len);
+}
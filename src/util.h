@@ -1,5 +1,17 @@
+/* bounded blocking FIFO of pointers, to hand work between threads */
+typedef struct {
+    void            **items;
+    size_t          capacity;
+    size_t          head;
+    size_t          count;
+    pthread_mutex_t lock;
+    pthread_cond_t  notempty;
+    pthread_cond_t  notfull;
+} Queue;
+
 void     die(const char *errstr, ...);
 void     xfclose(FILE *fp);
+void     xfflush(FILE *fp);
 FILE     *xfopen(const char *filename, const char *mode);
 void     xfread(void *ptr, size_t size, size_t nmemb, FILE *stream);
 void     xfwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
@@ -7,12 +19,38 @@ void     xfseek(FILE *fp, long offset, int whence);
 DIR      *xopendir(const char *name);
 void     xclosedir(DIR *dirp);
 void     *xmalloc(size_t size);
+void     *xrealloc(void *ptr, size_t size);
+char     *xstrdup(const char *s);
+void     *xalignedalloc(size_t alignment, size_t size);
+int      xopen(const char *pathname, int flags);
+void     xclose(int fd);
+void     xpread(int fd, void *buf, size_t count, off_t offset);
+void     xpwrite(int fd, const void *buf, size_t count, off_t offset);
+void     xwrite(int fd, const void *buf, size_t count);
+void     xwritepipe(int fd, const void *buf, size_t count);
+void     xcopyrange(int infd, int outfd, off_t inoffset, off_t outoffset, size_t length);
+off_t    xfilesize(int fd);
+void     *xmmap(size_t length, int prot, int flags, int fd, off_t offset);
+void     xmunmap(void *addr, size_t length);
+void     xpthread_create(pthread_t *thread, void *(*routine)(void *), void *arg);
+void     xpthread_join(pthread_t thread);
 size_t   xsnprintf(char *str, size_t size, const char *fmt, ...);
 long int xstrtol(const char *nptr, char **end, int base);
 
+void   queueinit(Queue *q, size_t capacity);
+void   queuefree(Queue *q);
+void   queuepush(Queue *q, void *item);
+void   *queuepop(Queue *q);
+double monotime(void);
+double residentfraction(int fd, size_t length);
+
 int  mod(int a, int b);
+int  gcd(int a, int b);
 
 bool isbigendian(void);
 void uint16swap(uint16_t *x);
 void uint32swap(uint32_t *x);
+void uint64swap(uint64_t *x);
 void int32swap(int32_t *x);
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
@@ -9,3 +9,15 @@ mkdir -p outputs
 ../bin/bmpsss -r --secret outputs/output1.bmp -k 8 -w 300 -h 300 --dir unpermuted_300x300
 ../bin/bmpsss -r --secret outputs/output2.bmp -k 8 -w 450 -h 300 --dir unpermuted_450x300
 ../bin/bmpsss -r --secret outputs/output3.bmp -k 8 -w 300 -h 450 --dir unpermuted_300x450
+
+# Try extending a distribution while one of its shadows is corrupted: it must
+# be skipped, and the new shadow must recover the same image as the others
+mkdir -p extend-tmp/covers
+for f in unpermuted_*/*.bmp; do cp "$f" extend-tmp/covers/"$(echo "$f" | tr / -)"; done
+../bin/bmpsss -d --secret Albert.bmp -w 300 -h 300 -k 8 -n 10 --dir extend-tmp/covers --out-dir extend-tmp
+head -c 4096 /dev/zero | tr '\0' '\377' | dd of=extend-tmp/shadow1.bmp bs=1 seek=5000 conv=notrunc 2>/dev/null
+../bin/bmpsss -e 11 --cover unpermuted_300x300/Albertssd.bmp -k 8 -w 300 -h 300 --dir extend-tmp --out-dir extend-tmp
+../bin/bmpsss -r --secret outputs/extend_before.bmp -k 8 -w 300 -h 300 --dir extend-tmp
+rm extend-tmp/shadow[1-3].bmp
+../bin/bmpsss -r --secret outputs/extend_after.bmp -k 8 -w 300 -h 300 --dir extend-tmp
+cmp outputs/extend_before.bmp outputs/extend_after.bmp && echo "extend with a corrupted shadow: ok"